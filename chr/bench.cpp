@@ -0,0 +1,418 @@
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "chr.hpp"
+#include "kernels.hpp"
+#include "png.hpp"
+#include "convert.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+namespace {
+    struct Result {
+        double per_second; // calls per second
+        double cycles;     // TSC cycles per call, 0 if unknown
+    };
+
+    // calls fn for at least min_time
+    template <typename F>
+    Result measure(F &&fn)
+    {
+        using clock = std::chrono::steady_clock;
+        const auto min_time = std::chrono::milliseconds(200);
+        std::size_t iters = 0;
+        auto start = clock::now();
+        auto elapsed = clock::duration{};
+#ifdef HAVE_RDTSC
+        uint64_t start_tsc = __rdtsc();
+#endif
+        do {
+            fn();
+            iters++;
+            elapsed = clock::now() - start;
+        } while (elapsed < min_time);
+#ifdef HAVE_RDTSC
+        double cycles = double(__rdtsc() - start_tsc) / iters;
+#else
+        double cycles = 0;
+#endif
+        return { double(iters) / std::chrono::duration<double>(elapsed).count(), cycles };
+    }
+
+    const char *mode_name(chr::DataMode mode)
+    {
+        return mode == chr::DataMode::Planar ? "planar" : "interwined";
+    }
+
+    std::vector<uint8_t> random_bytes(std::size_t n, uint8_t mask = 0xFF)
+    {
+        static uint32_t seed = 1;
+        std::vector<uint8_t> bytes(n);
+        for (auto &b : bytes) {
+            seed = seed * 1103515245 + 12345;
+            b = (seed >> 16) & mask;
+        }
+        return bytes;
+    }
+
+    // throughput of every kernel at every SIMD level
+    void bench_kernels()
+    {
+        const std::size_t num_tiles = 4096;
+        const int num_levels = static_cast<int>(chr::best_simd_level()) + 1;
+
+        fmt::print("kernel throughput (Mtiles/s), decode / encode\n");
+        fmt::print("{:>3} {:>10}", "bpp", "mode");
+        for (int l = 0; l < num_levels; l++)
+            fmt::print(" {:>15}", chr::simd_level_name(static_cast<chr::SimdLevel>(l)));
+        fmt::print("\n");
+
+        for (int bpp = 1; bpp <= 8; bpp++) {
+            auto tiles = random_bytes(num_tiles * bpp*8);
+            std::vector<uint8_t> pixels(num_tiles * 64);
+            std::vector<uint8_t> out(num_tiles * bpp*8);
+            for (auto mode : { chr::DataMode::Planar, chr::DataMode::Interwined }) {
+                fmt::print("{:>3} {:>10}", bpp, mode_name(mode));
+                auto index = chr::kernels::codec_index(bpp, mode);
+                for (int l = 0; l < num_levels; l++) {
+                    const auto &codec = chr::kernels::codec_table(static_cast<chr::SimdLevel>(l))[index];
+                    auto dec = measure([&] { codec.decode(tiles.data(), num_tiles, pixels.data(), num_tiles*8); });
+                    auto enc = measure([&] { codec.encode(pixels.data(), num_tiles, num_tiles*8, out.data()); });
+                    // levels whose decoder is slower than the scalar one use that instead
+                    bool scalar_decode = l > 0 && codec.decode == chr::kernels::scalar_codecs[index].decode;
+                    fmt::print(" {:>15}", fmt::format("{}{:.1f} / {:.1f}", scalar_decode ? "*" : "",
+                                                      dec.per_second * num_tiles / 1e6, enc.per_second * num_tiles / 1e6));
+                }
+                fmt::print("\n");
+            }
+        }
+        fmt::print("* decoded by the scalar kernel, which is faster there\n\n");
+    }
+
+    void print_result(std::string_view name, int bpp, std::string_view mode, std::size_t size, std::size_t tiles, Result r)
+    {
+        fmt::print("{:<18} {:>3} {:>10} {:>8} {:>12.3f} {:>12.1f} {:>12}\n",
+                   name, bpp, mode,
+                   size >= 1024*1024 ? fmt::format("{}M", size / (1024*1024))
+                 : size >= 1024      ? fmt::format("{}K", size / 1024)
+                 :                     fmt::format("{}", size),
+                   r.per_second * tiles / 1e6, r.per_second * size / (1024*1024),
+                   r.cycles != 0 ? fmt::format("{:.1f}", r.cycles / tiles) : "-");
+    }
+
+    // the public API, with inputs going from one tile to 64M. sizes are of
+    // the data each function reads: chr for to_indexed and decode_into, one byte per pixel
+    // for to_chr and indexed_to_palette, RGBA for palette_to_indexed
+    void bench_api()
+    {
+        const std::size_t sizes[] = { 0, 8*1024, 1024*1024, 64*1024*1024 }; // 0 = one tile
+
+        fmt::print("{:<18} {:>3} {:>10} {:>8} {:>12} {:>12} {:>12}\n",
+                   "function", "bpp", "mode", "size", "Mtiles/s", "MB/s", "cycles/tile");
+        for (int bpp = 1; bpp <= 8; bpp++) {
+            for (auto mode : { chr::DataMode::Planar, chr::DataMode::Interwined }) {
+                for (auto size : sizes) {
+                    size = size == 0 ? bpp*8 : size / (bpp*8) * (bpp*8);
+                    auto data = random_bytes(size);
+                    uint8_t sum = 0;
+                    auto r = measure([&] {
+                        chr::to_indexed(data, bpp, mode, [&](std::span<uint8_t> row) { sum += row[0]; });
+                    });
+                    print_result("to_indexed", bpp, mode_name(mode), size, size / (bpp*8), r);
+                }
+                // the whole image is kept, which for 64M would take gigabytes
+                for (auto size : sizes) {
+                    if (size > 1024*1024)
+                        continue;
+                    size = size == 0 ? bpp*8 : size / (bpp*8) * (bpp*8);
+                    auto data = random_bytes(size);
+                    std::size_t num_pixels = chr::img_height(size, bpp) * chr::ROW_SIZE;
+                    std::vector<uint8_t> indexed(num_pixels);
+                    auto r = measure([&] { chr::decode_into(data, indexed, chr::ROW_SIZE, bpp, mode); });
+                    print_result("decode_into", bpp, mode_name(mode), size, size / (bpp*8), r);
+                    std::vector<uint32_t> colors(num_pixels);
+                    chr::Palette palette{bpp};
+                    r = measure([&] {
+                        chr::decode_into(data, colors, chr::ROW_SIZE, bpp, mode, palette, chr::PixelFormat::BGRA);
+                    });
+                    print_result("decode_into bgra", bpp, mode_name(mode), size, size / (bpp*8), r);
+                }
+                for (auto size : sizes) {
+                    // width is a whole number of tiles, up to a row of the images to_indexed makes
+                    size = size == 0 ? 64 : size;
+                    std::size_t width = std::min<std::size_t>(size / 8, chr::ROW_SIZE);
+                    auto pixels = random_bytes(size, (1 << bpp) - 1);
+                    uint8_t sum = 0;
+                    auto r = measure([&] {
+                        chr::to_chr(std::span{pixels}, width, size / width, bpp, mode, [&](std::span<uint8_t> tile) { sum += tile[0]; });
+                    });
+                    print_result("to_chr", bpp, mode_name(mode), size, size / 64, r);
+                }
+            }
+
+            // these don't depend on the data mode, only on the palette size
+            chr::Palette palette{bpp};
+            for (auto size : sizes) {
+                size = size == 0 ? 64*4 : size;
+                auto indexes = random_bytes(size / 4, (1 << bpp) - 1);
+                std::vector<uint8_t> rgba(size);
+                for (std::size_t i = 0; i < indexes.size(); i++)
+                    for (int c = 0; c < 4; c++)
+                        rgba[i*4 + c] = palette[indexes[i]][c];
+                chr::ColorReport report;
+                auto r = measure([&] { chr::palette_to_indexed(rgba, chr::ROW_SIZE, palette, 4, report); });
+                print_result("palette_to_indexed", bpp, "-", size, size / 4 / 64, r);
+            }
+            for (auto size : sizes) {
+                size = size == 0 ? 64 : size;
+                auto indexes = random_bytes(size, (1 << bpp) - 1);
+                auto r = measure([&] { chr::indexed_to_palette(indexes, palette); });
+                print_result("indexed_to_palette", bpp, "-", size, size / 64, r);
+            }
+        }
+    }
+
+    // deterministic, so that every run converts the same files
+    struct Random {
+        uint32_t seed;
+        uint32_t next(uint32_t n)
+        {
+            seed = seed * 1103515245 + 12345;
+            return (seed >> 8) % n;
+        }
+    };
+
+    enum class Corpus { Random, Sparse, Repetitive, RealWorld };
+    const char *corpus_name(Corpus c)
+    {
+        const char *names[] = { "random", "sparse", "repetitive", "real-world" };
+        return names[static_cast<int>(c)];
+    }
+
+    // an image ROW_SIZE pixels wide with num_tiles tiles, as palette indexes:
+    // - random: noise, the worst case for compression and color lookups
+    // - sparse: mostly empty tiles, with a few pixels set in the others
+    // - repetitive: a handful of tiles repeated over and over
+    // - real-world: blank and repeated tiles, the others made of a
+    //   background and a few rectangles, like the tiles of actual games
+    std::vector<uint8_t> make_corpus(Corpus kind, std::size_t num_tiles, int bpp)
+    {
+        Random rng{uint32_t(static_cast<int>(kind) * 7919 + bpp)};
+        const uint32_t colors = 1u << bpp;
+        std::vector<std::array<uint8_t, 64>> tiles(num_tiles);
+        std::array<std::array<uint8_t, 64>, 8> unique;
+        for (auto &t : unique)
+            for (auto &p : t)
+                p = rng.next(colors);
+
+        for (std::size_t i = 0; i < num_tiles; i++) {
+            auto &tile = tiles[i];
+            tile.fill(0);
+            switch (kind) {
+            case Corpus::Random:
+                for (auto &p : tile)
+                    p = rng.next(colors);
+                break;
+            case Corpus::Sparse:
+                if (rng.next(8) == 0)
+                    for (uint32_t n = 1 + rng.next(6); n > 0; n--)
+                        tile[rng.next(64)] = rng.next(colors);
+                break;
+            case Corpus::Repetitive:
+                tile = unique[rng.next(unique.size())];
+                break;
+            case Corpus::RealWorld:
+                switch (rng.next(4)) {
+                case 0: break;
+                case 1: tile = tiles[rng.next(i + 1)]; break;
+                default:
+                    tile.fill(rng.next(colors));
+                    for (uint32_t n = 1 + rng.next(3); n > 0; n--) {
+                        uint32_t x0 = rng.next(8), y0 = rng.next(8);
+                        uint32_t x1 = x0 + rng.next(8 - x0), y1 = y0 + rng.next(8 - y0);
+                        uint8_t color = rng.next(colors);
+                        for (uint32_t y = y0; y <= y1; y++)
+                            for (uint32_t x = x0; x <= x1; x++)
+                                tile[y*8 + x] = color;
+                    }
+                }
+                break;
+            }
+        }
+
+        std::vector<uint8_t> pixels(num_tiles * 64);
+        for (std::size_t i = 0; i < num_tiles; i++) {
+            std::size_t tx = i % chr::TILES_PER_ROW, ty = i / chr::TILES_PER_ROW;
+            for (std::size_t y = 0; y < 8; y++)
+                std::memcpy(&pixels[(ty*8 + y) * chr::ROW_SIZE + tx*8], &tiles[i][y*8], 8);
+        }
+        return pixels;
+    }
+
+    bool write_file(const std::string &filename, std::span<const uint8_t> data)
+    {
+        FILE *fp = fopen(filename.c_str(), "wb");
+        if (!fp)
+            return false;
+        bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+        return fclose(fp) == 0 && ok;
+    }
+
+    bool write_indexed_png(const std::string &filename, std::span<const uint8_t> pixels, int bpp)
+    {
+        FILE *fp = fopen(filename.c_str(), "wb");
+        if (!fp)
+            return false;
+        png::IndexedWriter writer;
+        bool ok = writer.start(fp, chr::ROW_SIZE, pixels.size() / chr::ROW_SIZE, bpp, chr::Palette{bpp});
+        for (std::size_t i = 0; ok && i < pixels.size(); i += chr::ROW_SIZE)
+            ok = writer.write_row(pixels.subspan(i, chr::ROW_SIZE));
+        ok = ok && writer.finish();
+        return fclose(fp) == 0 && ok;
+    }
+
+    // the same image as RGBA, which can't take the indexed PNG fast path
+    bool write_rgba_png(const std::string &filename, std::span<const uint8_t> pixels, int bpp)
+    {
+        chr::Palette palette{bpp};
+        const std::size_t width = chr::ROW_SIZE, height = pixels.size() / width;
+        std::vector<uint8_t> raw;
+        raw.reserve(height * (1 + width*4));
+        for (std::size_t y = 0; y < height; y++) {
+            raw.push_back(0); // no filter
+            for (std::size_t x = 0; x < width; x++)
+                for (int c = 0; c < 4; c++)
+                    raw.push_back(palette[pixels[y*width + x]][c]);
+        }
+        uLongf size = compressBound(raw.size());
+        std::vector<uint8_t> idat(size);
+        if (compress(idat.data(), &size, raw.data(), raw.size()) != Z_OK)
+            return false;
+        idat.resize(size);
+
+        std::vector<uint8_t> file = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        auto put32 = [&](uint32_t n) {
+            for (int s = 24; s >= 0; s -= 8)
+                file.push_back(n >> s);
+        };
+        auto chunk = [&](const char *type, std::span<const uint8_t> data) {
+            put32(data.size());
+            std::size_t start = file.size();
+            file.insert(file.end(), type, type + 4);
+            file.insert(file.end(), data.begin(), data.end());
+            put32(crc32(0, &file[start], file.size() - start));
+        };
+        const uint8_t ihdr[] = { uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+                                 uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height),
+                                 8, 6, 0, 0, 0 };
+        chunk("IHDR", ihdr);
+        chunk("IDAT", idat);
+        chunk("IEND", {});
+        return write_file(filename, file);
+    }
+
+    void print_phases(std::string_view conv, std::string_view corpus, std::string_view format, std::size_t size,
+                      const PhaseTimes &t, std::size_t runs)
+    {
+        auto ms = [&](double s) { return s * 1e3 / runs; };
+        fmt::print("{:<16} {:<10} {:<4} {:>5} {:>9.3f} {:>8.3f} {:>8.3f} {:>9.3f} {:>8.3f} {:>8.3f} {:>8.1f}\n",
+                   conv, corpus, format, size >= 1024*1024 ? fmt::format("{}M", size / (1024*1024)) : fmt::format("{}K", size / 1024),
+                   ms(t.total()), ms(t.load), ms(t.decode), ms(t.palettize), ms(t.encode), ms(t.write),
+                   size / (1024.0*1024.0) * runs / t.total());
+    }
+
+    // whole chrconvert conversions of files written to dir, with the time
+    // of each step. sizes are of the chr data; MB/s too
+    bool bench_convert_in(const std::filesystem::path &dir)
+    {
+        auto path = [&](std::string_view name) { return (dir / name).string(); };
+
+        struct Format { const char *name; int bpp; chr::DataMode mode; };
+        const Format formats[] = { { "nes", 2, chr::DataMode::Planar }, { "snes", 4, chr::DataMode::Interwined } };
+        const std::size_t sizes[] = { 8*1024, 1024*1024 };
+
+        fmt::print("whole conversions, ms per file\n");
+        fmt::print("{:<16} {:<10} {:<4} {:>5} {:>9} {:>8} {:>8} {:>9} {:>8} {:>8} {:>8}\n",
+                   "conversion", "corpus", "fmt", "size", "total", "load", "decode", "palettize", "encode", "write", "MB/s");
+        bool ok = true;
+        for (auto kind : { Corpus::Random, Corpus::Sparse, Corpus::Repetitive, Corpus::RealWorld }) {
+            for (const auto &f : formats) {
+                for (auto size : sizes) {
+                    auto pixels = make_corpus(kind, size / (f.bpp*8), f.bpp);
+                    std::vector<uint8_t> chr(size);
+                    chr::encode_into(pixels, chr::ROW_SIZE, pixels.size() / chr::ROW_SIZE, f.bpp, f.mode, chr);
+                    if (!write_file(path("in.chr"), chr) || !write_indexed_png(path("in.png"), pixels, f.bpp)
+                     || !write_rgba_png(path("in-rgba.png"), pixels, f.bpp)) {
+                        fmt::print(stderr, "error: couldn't write the corpus to {}\n", dir.string());
+                        return false;
+                    }
+
+                    auto run = [&](std::string_view conv, auto &&convert) {
+                        PhaseTimes times;
+                        std::size_t runs = 0;
+                        do {
+                            if (convert(&times) != 0)
+                                ok = false;
+                            runs++;
+                        } while (times.total() < 0.2);
+                        print_phases(conv, corpus_name(kind), f.name, size, times, runs);
+                    };
+                    run("chr -> png", [&](PhaseTimes *t) {
+                        return chr_to_image(path("in.chr").c_str(), path("out.png").c_str(), f.bpp, f.mode, {}, t);
+                    });
+                    run("png -> chr", [&](PhaseTimes *t) {
+                        return image_to_chr(path("in.png").c_str(), path("out.chr").c_str(), f.bpp, f.mode, {}, t);
+                    });
+                    run("rgba png -> chr", [&](PhaseTimes *t) {
+                        return image_to_chr(path("in-rgba.png").c_str(), path("out.chr").c_str(), f.bpp, f.mode, {}, t);
+                    });
+                }
+            }
+        }
+        fmt::print("\n");
+        return ok;
+    }
+
+    bool bench_convert()
+    {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        fs::path dir = fs::temp_directory_path(ec) / fmt::format("chrbench-{}", getpid());
+        if (ec || !fs::create_directories(dir, ec)) {
+            fmt::print(stderr, "error: couldn't create a temporary directory\n");
+            return false;
+        }
+        bool ok = bench_convert_in(dir);
+        fs::remove_all(dir, ec);
+        return ok;
+    }
+}
+
+// with no arguments, runs everything; otherwise only "kernels", "api" or "convert"
+int main(int argc, char *argv[])
+{
+    std::string_view which = argc > 1 ? argv[1] : "";
+    if (which != "" && which != "kernels" && which != "api" && which != "convert") {
+        fmt::print(stderr, "usage: chrbench [kernels | api | convert]\n");
+        return 1;
+    }
+    if (which == "" || which == "kernels")
+        bench_kernels();
+    if (which == "" || which == "api")
+        bench_api();
+    if (which == "" || which == "convert")
+        return bench_convert() ? 0 : 1;
+    return 0;
+}
@@ -1,33 +1,33 @@
 #include "chr.hpp"
+#include "kernels.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHR_HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 using u8  = uint8_t;
 using u32 = uint32_t;
+using u64 = uint64_t;
 
 namespace chr {
 
-const int TILES_PER_ROW = 16;
-const int TILE_WIDTH = 8;
-const int TILE_HEIGHT = 8;
-const int BPP = 2;
-const int BYTES_PER_TILE = BPP * 8;
-const int ROW_SIZE = TILES_PER_ROW * TILE_WIDTH;
-const int MAX_BPP = 8;
-
 namespace {
-    long filesize(FILE *f)
-    {
-        long pos = ftell(f);
-        fseek(f, 0, SEEK_END);
-        long res = ftell(f);
-        fseek(f, pos, SEEK_SET);
-        return res;
-    }
-
     constexpr inline uint64_t bitmask(uint8_t nbits)
     {
         return (1UL << nbits) - 1UL;
@@ -80,6 +80,9 @@ namespace {
     const auto palette_2bpp = make_default_palette<2>();
     const auto palette_3bpp = make_default_palette<3>();
     const auto palette_4bpp = make_default_palette<4>();
+    const auto palette_5bpp = make_default_palette<5>();
+    const auto palette_6bpp = make_default_palette<6>();
+    const auto palette_7bpp = make_default_palette<7>();
     const auto palette_8bpp = make_default_palette<8>();
 
     std::span<const ColorRGBA> get_palette(int bpp)
@@ -89,9 +92,9 @@ namespace {
         case 2:  return palette_2bpp;
         case 3:  return palette_3bpp;
         case 4:  return palette_4bpp;
-        case 5:  return make_default_palette<5>();
-        case 6:  return make_default_palette<6>();
-        case 7:  return make_default_palette<7>();
+        case 5:  return palette_5bpp;
+        case 6:  return palette_6bpp;
+        case 7:  return palette_7bpp;
         case 8:  return palette_8bpp;
         default:
             fprintf(stderr, "no default palette bpp of value %d\n", bpp);
@@ -104,12 +107,52 @@ namespace {
 
 Palette::Palette(int bpp)
     : data(get_palette(bpp))
-{ }
+{
+    build_lookup();
+}
+
+void Palette::build_lookup()
+{
+    // keep the table at most half full, so that probe sequences stay short
+    std::size_t size = 2;
+    shift = 31;
+    while (size < data.size() * 2) {
+        size *= 2;
+        shift--;
+    }
+    keys.assign(size, 0);
+    indexes.assign(size, -1);
+    gray.fill(-1);
+
+    for (std::size_t i = 0; i < data.size(); i++) {
+        // on duplicate colors the first one wins, like a linear search would do
+        if (find_color(data[i].packed()) != -1)
+            continue;
+        u32 key = data[i].packed();
+        std::size_t slot = key * 0x9E3779B1u >> shift;
+        while (indexes[slot] != -1)
+            slot = (slot + 1) & (size - 1);
+        keys[slot] = key;
+        indexes[slot] = i;
+        if (data[i].red() == data[i].green() && data[i].green() == data[i].blue() && data[i].alpha() == 0xFF)
+            gray[data[i].red()] = i;
+    }
+}
+
+int Palette::find_color(uint32_t packed) const
+{
+    std::size_t slot = packed * 0x9E3779B1u >> shift;
+    while (indexes[slot] != -1) {
+        if (keys[slot] == packed)
+            return indexes[slot];
+        slot = (slot + 1) & (keys.size() - 1);
+    }
+    return -1;
+}
 
 int Palette::find_color(ColorRGBA color) const
 {
-    auto it = std::find(data.begin(), data.end(), color);
-    return it != data.end() ? it - data.begin() : -1;
+    return find_color(color.packed());
 }
 
 void Palette::dump() const
@@ -120,151 +163,540 @@ void Palette::dump() const
 
 
 
-/* decoding functions (chr -> image) */
+/* file input */
 
 namespace {
-    u8 decode_pixel_planar(std::span<u8> tile, int row, int col, int bpp)
+    // appends the rest of fp to buf
+    void read_all(FILE *fp, std::vector<u8> &buf)
     {
-        u8 nbit = 7 - col;
-        u8 res = 0;
-        for (int i = 0; i < bpp; i++) {
-            u8 byte = tile[row + i*8];
-            u8 bit  = getbit(byte, nbit);
-            res     = setbit(res, i, bit);
+        const std::size_t chunk_size = 64 * 1024;
+        std::size_t len = buf.size();
+        for (;;) {
+            buf.resize(len + chunk_size);
+            std::size_t n = std::fread(buf.data() + len, 1, chunk_size, fp);
+            len += n;
+            if (n < chunk_size)
+                break;
         }
-        return res;
+        buf.resize(len);
+    }
+}
+
+FileData::FileData(FILE *fp, std::span<const uint8_t> start)
+{
+    if (start.empty())
+        *this = map_file(fp);
+    if (!mapped()) {
+        buf.assign(start.begin(), start.end());
+        read_all(fp, buf);
+    }
+    stats::add(stats::Counter::BytesRead, bytes().size());
+}
+
+FileData FileData::map_file(FILE *fp)
+{
+    FileData data;
+#ifdef CHR_HAVE_MMAP
+    struct stat st;
+    long pos = std::ftell(fp);
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || pos < 0 || st.st_size <= pos)
+        return data;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void *p = mmap(nullptr, st.st_size, PROT_READ, flags, fileno(fp), 0);
+    if (p == MAP_FAILED)
+        return data;
+    posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+    data.map      = static_cast<u8 *>(p);
+    data.map_size = st.st_size;
+    data.offset   = pos;
+    // leave the file as if it was read
+    std::fseek(fp, 0, SEEK_END);
+#endif
+    return data;
+}
+
+FileData::~FileData()
+{
+    unmap();
+}
+
+void FileData::unmap()
+{
+#ifdef CHR_HAVE_MMAP
+    if (map)
+        munmap(map, map_size);
+#endif
+    map = nullptr;
+}
+
+FileData & FileData::operator=(FileData &&other)
+{
+    if (this != &other) {
+        unmap();
+        map      = std::exchange(other.map, nullptr);
+        map_size = std::exchange(other.map_size, 0);
+        offset   = std::exchange(other.offset, 0);
+        buf      = std::move(other.buf);
     }
+    return *this;
+}
+
+std::span<const uint8_t> FileData::bytes() const
+{
+    if (map)
+        return std::span{map + offset, map_size - offset};
+    return std::span{buf};
+}
+
+
+
+/* ROM files */
+
+namespace {
+    constexpr std::size_t NES_HEADER_SIZE = 16;
+    constexpr std::size_t NES_TRAINER_SIZE = 512;
 
-    u8 decode_pixel_interwined(std::span<u8> tile, int row, int col, int bpp)
+    // NES 2.0 sizes are either a multiple of unit, with the upper bits in
+    // msb, or written as 2^E * (M*2+1) when msb is 0xF
+    std::optional<std::size_t> nes2_rom_size(u8 lsb, u8 msb, std::size_t unit)
     {
-        u8 nbit = 7 - col;
-        u8 res = 0;
-        for (int i = 0; i < bpp/2; i++) {
-            u8 lowbyte = tile[i*16 + row*2    ];
-            u8 hibyte  = tile[i*16 + row*2 + 1];
-            u8 lowbit  = getbit(lowbyte, nbit);
-            u8 hibit   = getbit(hibyte,  nbit);
-            res        = setbit(res, i*2,     lowbit);
-            res        = setbit(res, i*2 + 1, hibit);
-        }
-        if (bpp % 2 != 0) {
-            int i = bpp/2;
-            u8 byte = tile[i*16 + row];
-            u8 bit  = getbit(byte, nbit);
-            res     = setbit(res, i*2, bit);
+        if (msb != 0xF)
+            return (std::size_t(msb) << 8 | lsb) * unit;
+        int exponent = lsb >> 2;
+        if (exponent > 40)
+            return std::nullopt;
+        return (std::size_t(1) << exponent) * ((lsb & 3) * 2 + 1);
+    }
+}
+
+bool NesRom::is_rom(std::span<const uint8_t> data)
+{
+    return data.size() >= NES_HEADER_SIZE && std::memcmp(data.data(), "NES\x1A", 4) == 0;
+}
+
+std::optional<NesRom> NesRom::parse(std::span<const uint8_t> data)
+{
+    if (!is_rom(data)) {
+        std::fprintf(stderr, "error: not an iNES ROM\n");
+        return std::nullopt;
+    }
+
+    const u8 *header = data.data();
+    NesRom rom;
+    rom.nes2 = (header[7] & 0x0C) == 0x08;
+    rom.has_trainer = header[6] & 0x04;
+    std::optional<std::size_t> prg_size, chr_size;
+    if (rom.nes2) {
+        rom.mapper    = (header[8] & 0x0F) << 8 | (header[7] & 0xF0) | header[6] >> 4;
+        rom.submapper = header[8] >> 4;
+        prg_size = nes2_rom_size(header[4], header[9] & 0x0F, 16 * 1024);
+        chr_size = nes2_rom_size(header[5], header[9] >> 4,   8 * 1024);
+    } else {
+        // old dumping tools wrote their names in the last bytes of the
+        // header, which makes the upper nibble of the mapper garbage
+        bool dirty = std::any_of(header + 12, header + 16, [](u8 b) { return b != 0; });
+        rom.mapper    = (dirty ? 0 : header[7] & 0xF0) | header[6] >> 4;
+        rom.submapper = 0;
+        prg_size = header[4] * std::size_t(16 * 1024);
+        chr_size = header[5] * std::size_t(8 * 1024);
+    }
+    if (!prg_size || !chr_size) {
+        std::fprintf(stderr, "error: invalid ROM size in header\n");
+        return std::nullopt;
+    }
+
+    std::size_t prg_start = NES_HEADER_SIZE + (rom.has_trainer ? NES_TRAINER_SIZE : 0);
+    if (data.size() < prg_start || data.size() - prg_start < prg_size.value()
+     || data.size() - prg_start - prg_size.value() < chr_size.value()) {
+        std::fprintf(stderr, "error: ROM is smaller than its header says\n");
+        return std::nullopt;
+    }
+    rom.prg = data.subspan(prg_start, prg_size.value());
+    rom.chr = data.subspan(prg_start + prg_size.value(), chr_size.value());
+    return rom;
+}
+
+std::span<const uint8_t> chr_bank(std::span<const uint8_t> chr, std::size_t size, std::size_t n)
+{
+    if (size == 0 || n >= chr.size() / size) {
+        std::fprintf(stderr, "error: no bank %zu of %zu bytes (data has %zu bytes)\n", n, size, chr.size());
+        return {};
+    }
+    return chr.subspan(n * size, size);
+}
+
+
+
+/* kernel selection */
+
+namespace {
+    const std::array<const char *, 5> simd_level_names = { "scalar", "sse2", "ssse3", "avx2", "avx512" };
+
+    // the CPU is only checked once. the CHR_SIMD environment variable
+    // can be used to force a lower level, e.g. for benchmarking
+    SimdLevel initial_simd_level()
+    {
+        SimdLevel best = best_simd_level();
+        const char *env = std::getenv("CHR_SIMD");
+        if (!env)
+            return best;
+        auto level = simd_level_from_name(env);
+        if (!level) {
+            std::fprintf(stderr, "warning: invalid value %s for CHR_SIMD\n", env);
+            return best;
         }
-        return res;
+        return std::min(level.value(), best);
     }
 
-    u8 decode_pixel(std::span<u8> tile, int row, int col, int bpp, DataMode mode)
+    std::atomic<SimdLevel> &current_level()
     {
-        return mode == DataMode::Planar ? decode_pixel_planar(tile, row, col, bpp)
-                                        : decode_pixel_interwined(tile, row, col, bpp);
+        static std::atomic<SimdLevel> level{initial_simd_level()};
+        return level;
     }
 
-    // when converting tiles, they are converted row-wise, i.e. first we convert
-    // the first row of every single tile, then the second, etc...
-    // decode_pixel()'s job is to do the conversion for one single tile
-    std::array<u8, ROW_SIZE> decode_row(std::span<u8> tiles, int row, int num_tiles, int bpp, DataMode mode)
+    // picks the kernels specialized for bpp and mode, the only point where
+    // those are checked at runtime
+    const kernels::Codec *find_codec(int bpp, DataMode mode)
     {
-        int bpt = bpp*8;
-        std::array<u8, ROW_SIZE> res;
-        // i = tile number; j = tile column
-        for (int i = 0; i < TILES_PER_ROW; i++) {
-            std::span<u8> tile = tiles.subspan(i*bpt, bpt);
-            for (int j = 0; j < 8; j++) {
-                res[i*8 + j] = i < num_tiles ? decode_pixel(tile, row, j, bpp, mode) : 0;
-            }
+        if (bpp < 1 || bpp > MAX_BPP) {
+            std::fprintf(stderr, "error: bpp can only be 1 to 8\n");
+            return nullptr;
         }
-        return res;
+        return &kernels::codec_table(current_level())[kernels::codec_index(bpp, mode)];
     }
 }
 
-void to_indexed(std::span<uint8_t> bytes, int bpp, DataMode mode, Callback draw_row)
-{
-    // this loop inspect 16 tiles each iteration
-    // the inner loop gets one single row of pixels, with size equal to the
-    // width of the resulting image
-    int bpt = bpp*8;
-    for (std::size_t index = 0; index < bytes.size(); index += bpt * TILES_PER_ROW) {
-        std::size_t bytes_remaining = bytes.size() - index;
-        std::size_t count = std::min(bytes_remaining, (std::size_t) bpt * TILES_PER_ROW);
-        int num_tiles = count / bpt;
-        std::span<u8> tiles = bytes.subspan(index, count);
-        for (int r = 0; r < TILE_HEIGHT; r++) {
-            auto row = decode_row(tiles, r, num_tiles, bpp, mode);
-            draw_row(row);
+namespace detail {
+    DecodeFn find_decoder(int bpp, DataMode mode)
+    {
+        const auto *codec = find_codec(bpp, mode);
+        return codec ? codec->decode : nullptr;
+    }
+
+    EncodeFn find_encoder(std::size_t width, std::size_t height, int bpp, DataMode mode)
+    {
+        if (width % 8 != 0 || height % 8 != 0) {
+            std::fprintf(stderr, "error: width and height must be a power of 8");
+            return nullptr;
         }
+        const auto *codec = find_codec(bpp, mode);
+        return codec ? codec->encode : nullptr;
     }
 }
 
-void to_indexed(FILE *fp, int bpp, DataMode mode, Callback callback)
+SimdLevel simd_level()
+{
+    return current_level();
+}
+
+SimdLevel best_simd_level()
 {
-    long size = filesize(fp);
-    auto ptr = std::make_unique<u8[]>(size);
-    std::fread(ptr.get(), 1, size, fp);
-    to_indexed(std::span{ptr.get(), std::size_t(size)}, bpp, mode, callback);
+    static const SimdLevel best = kernels::detect_simd_level();
+    return best;
 }
 
+// levels not supported by the CPU fall back to the best one available,
+// which is also returned
+SimdLevel set_simd_level(SimdLevel level)
+{
+    level = std::min(level, best_simd_level());
+    current_level() = level;
+    return level;
+}
+
+const char *simd_level_name(SimdLevel level)
+{
+    return simd_level_names[static_cast<int>(level)];
+}
+
+std::optional<SimdLevel> simd_level_from_name(std::string_view name)
+{
+    for (std::size_t i = 0; i < simd_level_names.size(); i++)
+        if (name == simd_level_names[i])
+            return static_cast<SimdLevel>(i);
+    return std::nullopt;
+}
 
 
-/* encoding functions (image -> chr) */
+
+/* threads */
 
 namespace {
-    // encode single row of tile, returns a byte for each plane
-    std::array<u8, MAX_BPP> encode_row(std::span<u8> row, int bpp)
+    unsigned max_threads()
     {
-        std::array<u8, MAX_BPP> bytes;
-        for (int i = 0; i < bpp; i++) {
-            u8 byte = 0;
-            for (int c = 0; c < 8; c++) {
-                u8 bits = row[c];
-                byte = setbit(byte, 7-c, getbit(bits, i));
+        static const unsigned n = std::max(std::thread::hardware_concurrency(), 1u);
+        return n;
+    }
+
+    std::atomic<unsigned> &thread_count()
+    {
+        static std::atomic<unsigned> n{max_threads()};
+        return n;
+    }
+
+    // a set of threads waiting for jobs made of a number of tasks. the
+    // thread calling run() works on the tasks too. threads are only added
+    // when a job asks for more of them
+    class ThreadPool {
+        using Job = std::function<void(std::size_t)>;
+
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake, done;
+        const Job *job = nullptr;
+        std::size_t num_tasks = 0;
+        std::atomic<std::size_t> next_task = 0;
+        std::size_t finished = 0;
+        unsigned generation = 0;
+        bool stop = false;
+        // only one job runs at a time
+        std::mutex busy;
+
+        void do_tasks(const Job &job)
+        {
+            for (std::size_t i; (i = next_task++) < num_tasks; )
+                job(i);
+        }
+
+        // seen is the last job the worker doesn't have to take part in
+        void work(unsigned seen)
+        {
+            std::unique_lock lock{mutex};
+            for (;;) {
+                wake.wait(lock, [&] { return stop || generation != seen; });
+                if (stop)
+                    return;
+                seen = generation;
+                const Job *current = job;
+                lock.unlock();
+                do_tasks(*current);
+                lock.lock();
+                // every worker has to go through every job before the next
+                // one can start, so none of them is left with a stale one
+                if (++finished == workers.size())
+                    done.notify_one();
+            }
+        }
+
+    public:
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard lock{mutex};
+                stop = true;
+            }
+            wake.notify_all();
+            for (auto &w : workers)
+                w.join();
+        }
+
+        void run(std::size_t n, const Job &fn)
+        {
+            // when the pool is already busy (e.g. calls from different
+            // threads) the caller does everything on its own
+            std::unique_lock running{busy, std::try_to_lock};
+            if (!running || n == 1) {
+                for (std::size_t i = 0; i < n; i++)
+                    fn(i);
+                return;
+            }
+            {
+                std::lock_guard lock{mutex};
+                // nobody is working, so workers can be added safely
+                while (workers.size() < n - 1)
+                    workers.emplace_back([this, seen = generation] { work(seen); });
+                job = &fn;
+                num_tasks = n;
+                next_task = 0;
+                finished = 0;
+                generation++;
             }
-            bytes[i] = byte;
+            wake.notify_all();
+            do_tasks(fn);
+            std::unique_lock lock{mutex};
+            done.wait(lock, [&] { return finished == workers.size(); });
         }
-        return bytes;
+    };
+
+    ThreadPool &thread_pool()
+    {
+        static ThreadPool pool;
+        return pool;
     }
 
-    // loop over the rows of a single tile, returns bytes of encoded tile. si = start index
-    std::array<u8, MAX_BPP*8> encode_tile(std::span<u8> tiles, std::size_t si, std::size_t width, int bpp, DataMode mode)
+    // calls fn(begin, end) on ranges of [0, count) with at least
+    // min_size items each, on as many threads as there are ranges
+    template <typename F>
+    void parallel_for(std::size_t count, std::size_t min_size, F &&fn)
     {
-        std::array<u8, MAX_BPP*8> res;
-        for (int y = 0; y < TILE_HEIGHT; y++) {
-            std::size_t ri = si + y*width;
-            auto bytes = encode_row(tiles.subspan(ri, TILE_WIDTH), bpp);
-            if (mode == DataMode::Planar) {
-                for (int i = 0; i < bpp; i++)
-                    res[y + i*8] = bytes[i];
-            } else {
-                for (int i = 0; i < bpp/2; i++) {
-                    res[i*16 + y*2    ] = bytes[i*2  ];
-                    res[i*16 + y*2 + 1] = bytes[i*2+1];
-                }
-                if (bpp % 2 != 0) {
-                    int i = bpp/2;
-                    res[i*16 + y] = bytes[i*2];
-                }
-            }
+        std::size_t tasks = std::min<std::size_t>(thread_count(), count / min_size);
+        if (tasks <= 1) {
+            fn(0, count);
+            return;
         }
-        return res;
+        std::size_t size = (count + tasks - 1) / tasks;
+        thread_pool().run(tasks, [&](std::size_t t) {
+            fn(std::min(count, t * size), std::min(count, (t+1) * size));
+        });
     }
 }
 
+unsigned num_threads()
+{
+    return thread_count();
+}
+
+unsigned set_num_threads(unsigned n)
+{
+    n = n == 0 ? max_threads() : std::min(n, 256u);
+    thread_count() = n;
+    return n;
+}
+
+
+
+/* decoding and encoding functions, see chr.hpp for the actual implementations */
+
+namespace detail {
+    void decode_strips(DecodeFn decode, std::span<const uint8_t> bytes, int bpp, uint8_t *out, std::size_t stride)
+    {
+        std::size_t bpt = bpp*8;
+        std::size_t strip_size = bpt * TILES_PER_ROW;
+        std::size_t num_strips = (bytes.size() + strip_size - 1) / strip_size;
+        parallel_for(num_strips, PARALLEL_MIN_STRIPS, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t s = begin; s < end; s++) {
+                std::size_t index = s * strip_size;
+                std::size_t num_tiles = std::min(bytes.size() - index, strip_size) / bpt;
+                u8 *dest = out + s * TILE_HEIGHT * stride;
+                decode(&bytes[index], num_tiles, dest, stride);
+                // missing tiles at the end are left blank, as in to_indexed()
+                if (num_tiles < TILES_PER_ROW)
+                    for (int r = 0; r < TILE_HEIGHT; r++)
+                        std::memset(dest + r*stride + num_tiles*TILE_WIDTH, 0, (TILES_PER_ROW - num_tiles) * TILE_WIDTH);
+            }
+        });
+    }
+
+    void encode_rows(EncodeFn encode, std::span<const uint8_t> pixels, std::size_t width, int bpp, uint8_t *out)
+    {
+        // every row of tiles goes to a known offset, so threads don't need
+        // to coordinate and the result is the same as encoding serially
+        std::size_t row_size = width * TILE_HEIGHT;
+        std::size_t row_bytes = width / TILE_WIDTH * bpp*8;
+        std::size_t min_rows = std::max<std::size_t>(PARALLEL_MIN_STRIPS * ROW_SIZE * TILE_HEIGHT / row_size, 1);
+        parallel_for(pixels.size() / row_size, min_rows, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t r = begin; r < end; r++)
+                encode(&pixels[r * row_size], width / TILE_WIDTH, width, out + r * row_bytes);
+        });
+    }
+}
+
+void to_indexed(std::span<uint8_t> bytes, int bpp, DataMode mode, Callback draw_row)
+{
+    detail::to_indexed(bytes, bpp, mode, draw_row);
+}
+
+// containers go straight to the template, without having to be made into spans
+static_assert(requires(std::vector<uint8_t> v) { to_indexed(v, 2, DataMode::Planar, [](std::span<uint8_t>) { }); });
+
+void to_indexed(FILE *fp, int bpp, DataMode mode, Callback draw_row)
+{
+    to_indexed<Callback &>(fp, bpp, mode, draw_row);
+}
+
 void to_chr(std::span<u8> bytes, std::size_t width, std::size_t height, int bpp, DataMode mode, Callback write_data)
 {
-    if (width % 8 != 0 || height % 8 != 0) {
-        std::fprintf(stderr, "error: width and height must be a power of 8");
-        return;
+    to_chr<Callback &>(bytes, width, height, bpp, mode, write_data);
+}
+
+namespace {
+    bool check_output_size(std::size_t num_bytes, int bpp, std::size_t size, std::size_t stride)
+    {
+        std::size_t height = img_height(num_bytes, bpp);
+        if (stride < ROW_SIZE || (height > 0 && size < (height-1) * stride + ROW_SIZE)) {
+            std::fprintf(stderr, "error: output image is too small\n");
+            return false;
+        }
+        return true;
+    }
+
+    std::array<uint32_t, 256> make_lut(const Palette &palette, PixelFormat format)
+    {
+        std::array<uint32_t, 256> lut;
+        lut.fill(0);
+        for (std::size_t i = 0; i < std::min<std::size_t>(palette.size(), 256); i++) {
+            auto c = palette[i];
+            std::array<u8, 4> bytes = format == PixelFormat::RGBA
+                ? std::array<u8, 4>{ c.red(),  c.green(), c.blue(), c.alpha() }
+                : std::array<u8, 4>{ c.blue(), c.green(), c.red(),  c.alpha() };
+            std::memcpy(&lut[i], bytes.data(), 4);
+        }
+        return lut;
     }
+}
+
+bool decode_into(std::span<const uint8_t> chr, std::span<uint8_t> out, std::size_t stride, int bpp, DataMode mode)
+{
+    auto decode = detail::find_decoder(bpp, mode);
+    if (!decode || !check_output_size(chr.size(), bpp, out.size(), stride))
+        return false;
+
+    stats::add(stats::Counter::TilesDecoded, chr.size() / (bpp*8));
+    detail::decode_strips(decode, chr, bpp, out.data(), stride);
+    return true;
+}
+
+bool decode_into(std::span<const uint8_t> chr, std::span<uint32_t> out, std::size_t stride, int bpp, DataMode mode,
+                 const Palette &palette, PixelFormat format)
+{
+    auto decode = detail::find_decoder(bpp, mode);
+    if (!decode || !check_output_size(chr.size(), bpp, out.size(), stride))
+        return false;
 
-    for (std::size_t j = 0; j < bytes.size(); j += width*TILE_WIDTH) {
-        for (std::size_t i = 0; i < width; i += TILE_WIDTH) {
-            auto tile = encode_tile(bytes, j+i, width, bpp, mode);
-            std::span<u8> tilespan{tile.begin(), tile.begin() + bpp*8};
-            write_data(tilespan);
+    // each strip is decoded into a small buffer that stays in cache, then
+    // converted to colors while copying it into the image
+    stats::add(stats::Counter::TilesDecoded, chr.size() / (bpp*8));
+    auto palettize = kernels::palettize_kernel(current_level());
+    const auto lut = make_lut(palette, format);
+    std::size_t bpt = bpp*8;
+    std::size_t strip_size = bpt * TILES_PER_ROW;
+    std::size_t num_strips = (chr.size() + strip_size - 1) / strip_size;
+    parallel_for(num_strips, detail::PARALLEL_MIN_STRIPS, [&](std::size_t begin, std::size_t end) {
+        std::array<u8, ROW_SIZE * TILE_HEIGHT> rows;
+        for (std::size_t s = begin; s < end; s++) {
+            std::size_t index = s * strip_size;
+            std::size_t num_tiles = std::min(chr.size() - index, strip_size) / bpt;
+            if (num_tiles < TILES_PER_ROW)
+                rows.fill(0);
+            decode(&chr[index], num_tiles, rows.data(), ROW_SIZE);
+            for (int r = 0; r < TILE_HEIGHT; r++)
+                palettize(&rows[r * ROW_SIZE], ROW_SIZE, lut.data(), 1 << bpp, &out[(s * TILE_HEIGHT + r) * stride]);
         }
+    });
+    return true;
+}
+
+bool encode_into(std::span<const uint8_t> pixels, std::size_t width, std::size_t height, int bpp, DataMode mode,
+                 std::span<uint8_t> out)
+{
+    auto encode = detail::find_encoder(width, height, bpp, mode);
+    if (!encode)
+        return false;
+    if (pixels.size() < width * height) {
+        std::fprintf(stderr, "error: image is smaller than %zux%zu\n", width, height);
+        return false;
     }
+    if (out.size() < width * height / 64 * bpp*8) {
+        std::fprintf(stderr, "error: output buffer is too small\n");
+        return false;
+    }
+    stats::add(stats::Counter::TilesEncoded, width * height / 64);
+    if (width != 0)
+        detail::encode_rows(encode, pixels.first(width * height), width, bpp, out.data());
+    return true;
 }
 
 
@@ -280,20 +712,258 @@ long img_height(std::size_t num_bytes, int bpp)
     return num_bytes / bpt / TILES_PER_ROW * 8;
 }
 
-HeapArray<uint8_t> palette_to_indexed(std::span<uint8_t> data, const Palette &palette, int channels)
+/* palette conversion */
+
+namespace {
+    // open addressing hash table mapping packed colors to non-negative ints
+    class ColorMap {
+        std::vector<u32> keys;
+        std::vector<int> values; // -1 = empty slot
+        std::size_t count = 0;
+        int shift = 28;
+
+        std::size_t find_slot(u32 color) const
+        {
+            std::size_t slot = color * 0x9E3779B1u >> shift;
+            while (values[slot] != -1 && keys[slot] != color)
+                slot = (slot + 1) & (keys.size() - 1);
+            return slot;
+        }
+
+    public:
+        ColorMap() : keys(16, 0), values(16, -1) { }
+
+        int find(u32 color) const { return values[find_slot(color)]; }
+
+        void insert(u32 color, int value)
+        {
+            std::size_t slot = find_slot(color);
+            if (values[slot] == -1)
+                count++;
+            keys[slot] = color;
+            values[slot] = value;
+            if (count * 2 <= keys.size())
+                return;
+            auto old_keys = std::move(keys);
+            auto old_values = std::move(values);
+            keys.assign(old_keys.size() * 2, 0);
+            values.assign(old_values.size() * 2, -1);
+            shift--;
+            for (std::size_t i = 0; i < old_keys.size(); i++) {
+                if (old_values[i] != -1) {
+                    slot = find_slot(old_keys[i]);
+                    keys[slot] = old_keys[i];
+                    values[slot] = old_values[i];
+                }
+            }
+        }
+    };
+
+    // records colors that aren't in the palette
+    class UnmatchedColors {
+        ColorReport &report;
+        ColorMap entries; // color -> index into report.unmatched
+
+    public:
+        explicit UnmatchedColors(ColorReport &r) : report(r) { }
+
+        void add(ColorRGBA color, std::size_t x, std::size_t y)
+        {
+            report.total++;
+            int i = entries.find(color.packed());
+            if (i != -1) {
+                report.unmatched[i].count++;
+                return;
+            }
+            entries.insert(color.packed(), report.unmatched.size());
+            report.unmatched.push_back({ color, 1, x, y });
+        }
+    };
+}
+
+void ColorReport::print(FILE *fp, std::size_t max_colors) const
+{
+    if (total == 0)
+        return;
+    fprintf(fp, "warning: %zu pixels have colors not present in palette (%zu different colors)\n",
+            total, unmatched.size());
+    for (std::size_t i = 0; i < std::min(max_colors, unmatched.size()); i++) {
+        const auto &e = unmatched[i];
+        fprintf(fp, "    #%08X: %zu pixels, first at (%zu, %zu)\n", e.color.packed(), e.count, e.x, e.y);
+    }
+    if (unmatched.size() > max_colors)
+        fprintf(fp, "    ... and %zu more\n", unmatched.size() - max_colors);
+}
+
+HeapArray<uint8_t> palette_to_indexed(std::span<uint8_t> data, std::size_t width, const Palette &palette, int channels,
+                                      ColorReport &report, std::size_t max_errors)
 {
     HeapArray<u8> output{data.size() / channels};
-    auto it = output.begin();
+    UnmatchedColors unmatched{report};
+    std::size_t old_total = report.total;
 
-    for (std::size_t i = 0; i < data.size(); i += channels) {
-        ColorRGBA color{data.subspan(i, channels)};
-        int index = palette.find_color(color);
+    // images usually have long runs of the same color, so remember the last
+    // one found and skip the lookup when it repeats
+    u32 last_color = 0;
+    int last_index = -1;
+    for (std::size_t i = 0; i < output.size(); i++) {
+        auto pixel = data.subspan(i * channels, channels);
+        int index;
+        if (channels == 1)
+            index = palette.find_gray(pixel[0]);
+        else {
+            u32 color = ColorRGBA{pixel}.packed();
+            index = color == last_color && last_index != -1 ? last_index
+                  : palette.find_color(color);
+            if (index != -1) {
+                last_color = color;
+                last_index = index;
+            }
+        }
         if (index == -1) {
-            fprintf(stderr, "warning: color not present in palette\n");
-            *it++ = 0;
-        } else
-            *it++ = index;
+            unmatched.add(ColorRGBA{pixel}, i % width, i / width);
+            if (max_errors != 0 && report.total >= max_errors) {
+                report.stopped = true;
+                break;
+            }
+            index = 0;
+        }
+        output[i] = index;
+    }
+    stats::add(stats::Counter::PaletteMisses, report.total - old_total);
+    return output;
+}
+
+HeapArray<uint8_t> palette_to_indexed(std::span<uint8_t> data, const Palette &palette, int channels)
+{
+    ColorReport report;
+    auto output = palette_to_indexed(data, data.size() / channels, palette, channels, report);
+    report.print(stderr);
+    return output;
+}
+
+namespace {
+    // converts a color to Oklab, with components scaled so that they fit in
+    // 13 bits and distances between any two colors fit in 31 bits. alpha is
+    // kept as a fourth component
+    std::array<int16_t, 4> to_perceptual(ColorRGBA color)
+    {
+        auto linear = [](u8 c) {
+            double v = c / 255.0;
+            return v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4);
+        };
+        double r = linear(color.red()), g = linear(color.green()), b = linear(color.blue());
+        double l = std::cbrt(0.4122214708*r + 0.5363325363*g + 0.0514459929*b);
+        double m = std::cbrt(0.2119034982*r + 0.6806995451*g + 0.1073969566*b);
+        double s = std::cbrt(0.0883024619*r + 0.2817188376*g + 0.6299787005*b);
+        return {
+            int16_t(std::lround((0.2104542553*l + 0.7936177850*m - 0.0040720468*s) * 4096)),
+            int16_t(std::lround((1.9779984951*l - 2.4285922050*m + 0.4505937099*s) * 4096)),
+            int16_t(std::lround((0.0259040371*l + 0.7827717662*m - 0.8086757660*s) * 4096)),
+            int16_t(color.alpha() * 16),
+        };
+    }
+
+    u32 pack_components(int16_t a, int16_t b)
+    {
+        return uint16_t(a) | u32(uint16_t(b)) << 16;
+    }
+
+    class Quantizer {
+        const Palette &palette;
+        // palette in the layout wanted by the nearest color kernels
+        std::vector<u32> pal0, pal1;
+        kernels::NearestFn nearest;
+        ColorMap cache;
+
+    public:
+        // how much to move colors when dithering
+        int spread = 0;
+        // whether the last color found was in the palette
+        bool exact = false;
+
+        explicit Quantizer(const Palette &p)
+            : palette(p), nearest(kernels::nearest_kernel(current_level()))
+        {
+            // padding entries are further away than any real color
+            std::size_t n = std::max<std::size_t>((p.size() + 15) / 16 * 16, 16);
+            pal0.assign(n, pack_components(-12000, 0));
+            pal1.assign(n, pack_components(0, -12000));
+            for (std::size_t i = 0; i < p.size(); i++) {
+                auto c = to_perceptual(p[i]);
+                pal0[i] = pack_components(c[0], c[1]);
+                pal1[i] = pack_components(c[2], c[3]);
+            }
+
+            // average distance between a palette color and its closest
+            // neighbor, counted as the biggest difference between channels
+            if (p.size() < 2)
+                return;
+            long total = 0;
+            for (std::size_t i = 0; i < p.size(); i++) {
+                int closest = 255;
+                for (std::size_t j = 0; j < p.size(); j++) {
+                    if (i == j)
+                        continue;
+                    int d = 0;
+                    for (int c = 0; c < 3; c++)
+                        d = std::max(d, std::abs(p[i][c] - p[j][c]));
+                    closest = std::min(closest, d);
+                }
+                total += closest;
+            }
+            spread = total / long(p.size());
+        }
+
+        int find(ColorRGBA color)
+        {
+            exact = true;
+            if (int index = palette.find_color(color); index != -1)
+                return index;
+            exact = false;
+            if (int index = cache.find(color.packed()); index != -1)
+                return index;
+            auto c = to_perceptual(color);
+            int index = palette.size() == 0 ? 0
+                      : nearest(pal0.data(), pal1.data(), pal0.size(), pack_components(c[0], c[1]), pack_components(c[2], c[3]));
+            cache.insert(color.packed(), index);
+            return index;
+        }
+    };
+
+    // 4x4 Bayer matrix
+    constexpr int bayer[4][4] = {
+        {  0,  8,  2, 10 },
+        { 12,  4, 14,  6 },
+        {  3, 11,  1,  9 },
+        { 15,  7, 13,  5 },
+    };
+}
+
+HeapArray<uint8_t> quantize_to_indexed(std::span<uint8_t> data, std::size_t width, const Palette &palette, int channels,
+                                       bool dither)
+{
+    HeapArray<u8> output{data.size() / channels};
+    Quantizer quantizer{palette};
+    u32 last_color = 0;
+    int last_index = -1;
+    std::size_t misses = 0;
+    for (std::size_t i = 0; i < output.size(); i++) {
+        ColorRGBA color{data.subspan(i * channels, channels)};
+        if (dither && quantizer.spread != 0) {
+            // move the color by up to half the distance between palette colors
+            int offset = (bayer[i / width % 4][i % width % 4] * 2 - 15) * quantizer.spread / 32;
+            auto move = [&](u8 c) { return u8(std::clamp(c + offset, 0, 255)); };
+            color = ColorRGBA{move(color.red()), move(color.green()), move(color.blue()), color.alpha()};
+        }
+        if (color.packed() != last_color || last_index == -1) {
+            last_color = color.packed();
+            last_index = quantizer.find(color);
+        }
+        misses += !quantizer.exact;
+        output[i] = last_index;
     }
+    stats::add(stats::Counter::PaletteMisses, misses);
     return output;
 }
 
@@ -301,8 +971,207 @@ HeapArray<ColorRGBA> indexed_to_palette(std::span<uint8_t> data, const Palette &
 {
     HeapArray<ColorRGBA> output{data.size()};
     for (std::size_t i = 0; i < data.size(); i++)
-        output[i] = palette[i];
+        output[i] = data[i] < palette.size() ? palette[data[i]] : ColorRGBA{};
     return output;
 }
 
+
+
+/* tile sets */
+
+namespace {
+    // every byte of an encoded tile is a row of one plane, leftmost pixel
+    // first, so reversing the bits of each byte flips rows horizontally
+    u64 flip_bytes(u64 w)
+    {
+        w = (w >> 4 & 0x0F0F0F0F0F0F0F0Fu) | (w & 0x0F0F0F0F0F0F0F0Fu) << 4;
+        w = (w >> 2 & 0x3333333333333333u) | (w & 0x3333333333333333u) << 2;
+        return (w >> 1 & 0x5555555555555555u) | (w & 0x5555555555555555u) << 1;
+    }
+
+    // reverses the order of the bytes or of the pairs of bytes in memory
+    u64 reverse_bytes(u64 w) { return __builtin_bswap64(w); }
+
+    u64 reverse_pairs(u64 w)
+    {
+        w = w >> 32 | w << 32;
+        return (w >> 16 & 0x0000FFFF0000FFFFu) | (w & 0x0000FFFF0000FFFFu) << 16;
+    }
+
+    // compares tiles as memcmp() would, a word at a time
+    bool less(const u64 *a, const u64 *b, std::size_t num_words)
+    {
+        for (std::size_t i = 0; i < num_words; i++)
+            if (a[i] != b[i])
+                return std::endian::native == std::endian::little ? reverse_bytes(a[i]) < reverse_bytes(b[i])
+                                                                  : a[i] < b[i];
+        return false;
+    }
+
+    // tiles are always a multiple of 8 bytes, so they're hashed a word at a time
+    u64 hash_tile(const u8 *tile, std::size_t size)
+    {
+        u64 h = size * 0x9E3779B97F4A7C15u;
+        for (std::size_t i = 0; i < size; i += 8) {
+            u64 word;
+            std::memcpy(&word, tile + i, 8);
+            h = (h ^ word) * 0xBF58476D1CE4E5B9u;
+            h ^= h >> 31;
+        }
+        return h;
+    }
+}
+
+TileSet::TileSet(int bpp, DataMode mode)
+    : tile_size(bpp*8), hashes(16, 0), indexes(16, UINT32_MAX), mode(mode)
+{ }
+
+std::size_t TileSet::find_slot(u64 hash, const u8 *tile) const
+{
+    std::size_t slot = hash >> shift;
+    while (indexes[slot] != UINT32_MAX
+        && (hashes[slot] != hash || std::memcmp(&data[indexes[slot] * tile_size], tile, tile_size) != 0))
+        slot = (slot + 1) & (indexes.size() - 1);
+    return slot;
+}
+
+void TileSet::grow()
+{
+    auto old_hashes = std::move(hashes);
+    auto old_indexes = std::move(indexes);
+    hashes.assign(old_hashes.size() * 2, 0);
+    indexes.assign(old_indexes.size() * 2, UINT32_MAX);
+    shift--;
+    for (std::size_t i = 0; i < old_indexes.size(); i++) {
+        if (old_indexes[i] == UINT32_MAX)
+            continue;
+        // every tile is different, so the first free slot is the one
+        std::size_t slot = old_hashes[i] >> shift;
+        while (indexes[slot] != UINT32_MAX)
+            slot = (slot + 1) & (indexes.size() - 1);
+        hashes[slot] = old_hashes[i];
+        indexes[slot] = old_indexes[i];
+    }
+}
+
+std::size_t TileSet::add(std::span<const uint8_t> tile)
+{
+    u64 hash = hash_tile(tile.data(), tile_size);
+    std::size_t slot = find_slot(hash, tile.data());
+    if (indexes[slot] != UINT32_MAX)
+        return indexes[slot];
+    std::size_t index = size();
+    hashes[slot] = hash;
+    indexes[slot] = index;
+    data.insert(data.end(), tile.begin(), tile.begin() + tile_size);
+    if (size() * 2 > indexes.size())
+        grow();
+    return index;
+}
+
+TileSet::Ref TileSet::add_flipped(std::span<const uint8_t> tile)
+{
+    // versions[f] is flipped horizontally if f & 1 and vertically if f & 2.
+    // tiles are handled 8 bytes at a time, which is a row of one plane
+    std::size_t num_words = tile_size / 8;
+    std::array<std::array<u64, MAX_BPP>, 4> versions;
+    std::memcpy(versions[0].data(), tile.data(), tile_size);
+    for (std::size_t i = 0; i < num_words; i++)
+        versions[1][i] = flip_bytes(versions[0][i]);
+    for (int f = 0; f < 2; f++) {
+        const auto &from = versions[f];
+        auto &to = versions[f + 2];
+        std::size_t i = 0;
+        // interwined tiles have rows of pairs of planes, 16 bytes for 8
+        // rows, so the two halves swap and the pairs are reversed
+        if (mode == DataMode::Interwined)
+            for ( ; i + 1 < num_words; i += 2) {
+                to[i]   = reverse_pairs(from[i+1]);
+                to[i+1] = reverse_pairs(from[i]);
+            }
+        for ( ; i < num_words; i++)
+            to[i] = reverse_bytes(from[i]);
+    }
+    int best = 0;
+    for (int f = 1; f < 4; f++)
+        if (less(versions[f].data(), versions[best].data(), num_words))
+            best = f;
+    // flips undo themselves, so the tile is the smallest version flipped the same way
+    return { add(std::span{reinterpret_cast<const u8 *>(versions[best].data()), tile_size}), (best & 1) != 0, (best & 2) != 0 };
+}
+
+
+
+/* statistics */
+
+namespace stats {
+
+Snapshot snapshot()
+{
+    Snapshot s;
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        s.counters[i] = detail::counters[i].load(std::memory_order_relaxed);
+    for (int i = 0; i < NUM_PHASES; i++)
+        s.seconds[i] = detail::phase_ns[i].load(std::memory_order_relaxed) / 1e9;
+    return s;
+}
+
+void reset()
+{
+    for (auto &c : detail::counters)
+        c.store(0, std::memory_order_relaxed);
+    for (auto &t : detail::phase_ns)
+        t.store(0, std::memory_order_relaxed);
+}
+
+const char *counter_name(Counter c)
+{
+    const char *names[] = { "files", "bytes_read", "tiles_decoded", "tiles_encoded", "palette_misses", "bytes_written" };
+    return names[static_cast<int>(c)];
+}
+
+const char *phase_name(Phase p)
+{
+    const char *names[] = { "load", "decode", "palettize", "encode", "write" };
+    return names[static_cast<int>(p)];
+}
+
+double clock_seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void print(FILE *fp, const Snapshot &s, double wall)
+{
+    if (!enabled) {
+        fprintf(fp, "statistics were disabled at build time\n");
+        return;
+    }
+    double total = 0;
+    for (auto t : s.seconds)
+        total += t;
+    fprintf(fp, "%-16s %12s %7s\n", "phase", "time (ms)", "%");
+    for (int i = 0; i < NUM_PHASES; i++)
+        fprintf(fp, "%-16s %12.3f %7.1f\n", phase_name(static_cast<Phase>(i)), s.seconds[i] * 1e3,
+                total == 0 ? 0.0 : s.seconds[i] / total * 100);
+    fprintf(fp, "%-16s %12.3f\n", "total", total * 1e3);
+    fprintf(fp, "%-16s %12.3f\n", "wall", wall * 1e3);
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        fprintf(fp, "%-16s %12llu\n", counter_name(static_cast<Counter>(i)), (unsigned long long) s.counters[i]);
+}
+
+void print_json(FILE *fp, const Snapshot &s, double wall)
+{
+    fprintf(fp, "{\"enabled\": %s, \"wall_seconds\": %.9f, \"phase_seconds\": {", enabled ? "true" : "false", wall);
+    for (int i = 0; i < NUM_PHASES; i++)
+        fprintf(fp, "%s\"%s\": %.9f", i == 0 ? "" : ", ", phase_name(static_cast<Phase>(i)), s.seconds[i]);
+    fprintf(fp, "}, \"counters\": {");
+    for (int i = 0; i < NUM_COUNTERS; i++)
+        fprintf(fp, "%s\"%s\": %llu", i == 0 ? "" : ", ", counter_name(static_cast<Counter>(i)),
+                (unsigned long long) s.counters[i]);
+    fprintf(fp, "}}\n");
+}
+
+} // namespace stats
+
 } // namespace chr
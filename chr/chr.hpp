@@ -1,22 +1,54 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <concepts>
 #include <cstdio>
 #include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <span>
 #include <memory>
+#include <vector>
+#include <optional>
+#include <string_view>
+#include "stats.hpp"
 
 namespace chr {
 
 using Callback  = std::function<void(std::span<uint8_t>)>;
 
+// anything that can be called like a Callback. the templated versions of
+// to_indexed and to_chr take these, so that the call can be inlined
+template <typename F>
+concept Sink = std::invocable<F &, std::span<uint8_t>>;
+
+constexpr int TILES_PER_ROW = 16;
+constexpr int TILE_WIDTH    = 8;
+constexpr int TILE_HEIGHT   = 8;
+constexpr int ROW_SIZE      = TILES_PER_ROW * TILE_WIDTH;
+constexpr int MAX_BPP       = 8;
+
 enum class DataMode {
     Planar,
     Interwined,
 };
 
+// byte order of packed 32-bit pixels, as laid out in memory
+enum class PixelFormat {
+    RGBA,
+    BGRA,
+};
+
+// instruction sets used by the encoding and decoding kernels, from worst to best
+enum class SimdLevel {
+    Scalar,
+    SSE2,
+    SSSE3,
+    AVX2,
+    AVX512,
+};
+
 class ColorRGBA {
     std::array<uint8_t, 4> data;
 
@@ -29,6 +61,9 @@ public:
         if (color.size() == 1) {
             data[0] = data[1] = data[2] = color[0];
             data[3] = 0xFF;
+        } else if (color.size() == 2) {
+            data[0] = data[1] = data[2] = color[0];
+            data[3] = color[1];
         } else {
             data[0] = color[0];
             data[1] = color[1];
@@ -42,6 +77,7 @@ public:
     constexpr uint8_t blue() const  { return data[2]; }
     constexpr uint8_t alpha() const { return data[3]; }
     constexpr uint8_t operator[](std::size_t i) const { return data[i]; }
+    constexpr uint32_t packed() const { return uint32_t(data[0]) << 24 | data[1] << 16 | data[2] << 8 | data[3]; }
     friend bool operator==(const ColorRGBA &c1, const ColorRGBA &c2);
 };
 
@@ -49,13 +85,25 @@ inline bool operator==(const ColorRGBA &c1, const ColorRGBA &c2) { return c1.dat
 
 class Palette {
     std::span<const ColorRGBA> data;
+    // open addressing table mapping packed colors to their index (-1 = empty
+    // slot), plus a direct table for gray colors
+    std::vector<uint32_t> keys;
+    std::vector<int16_t> indexes;
+    std::array<int16_t, 256> gray;
+    int shift;
+
+    void build_lookup();
 
 public:
     explicit Palette(int bpp);
-    explicit Palette(std::span<ColorRGBA> p) : data(p) {}
+    explicit Palette(std::span<ColorRGBA> p) : data(p) { build_lookup(); }
 
     const ColorRGBA & operator[](std::size_t pos) const { return data[pos]; }
+    std::size_t size() const { return data.size(); }
     int find_color(ColorRGBA color) const;
+    int find_color(uint32_t packed) const;
+    // index of the opaque color (value, value, value)
+    int find_gray(uint8_t value) const { return gray[value]; }
     void dump() const;
 };
 
@@ -73,11 +121,275 @@ public:
     T & operator[](std::size_t pos) { return ptr[pos]; }
 };
 
+// the contents of a file, starting from its current position. regular files
+// are memory mapped, anything else (pipes, terminals...) is read into memory
+class FileData {
+    uint8_t *map = nullptr;
+    std::size_t map_size = 0;
+    std::size_t offset = 0;
+    std::vector<uint8_t> buf;
+
+    void unmap();
+
+public:
+    FileData() = default;
+    // start has bytes already read from fp, which come first. only files
+    // that can't be mapped can have them
+    explicit FileData(FILE *fp, std::span<const uint8_t> start = {});
+    // maps fp if it's a regular file, otherwise doesn't read anything
+    static FileData map_file(FILE *fp);
+    ~FileData();
+    FileData(FileData &&other) { *this = std::move(other); }
+    FileData & operator=(FileData &&other);
+
+    std::span<const uint8_t> bytes() const;
+    bool mapped() const { return map != nullptr; }
+};
+
+// the parts of an iNES or NES 2.0 ROM file. prg and chr point into the
+// data the ROM was parsed from, which must outlive them
+struct NesRom {
+    bool nes2;
+    int mapper;
+    int submapper;      // always 0 for iNES
+    bool has_trainer;   // 512 bytes between the header and PRG-ROM
+    std::span<const uint8_t> prg;
+    std::span<const uint8_t> chr; // empty if the cartridge uses CHR-RAM
+
+    static bool is_rom(std::span<const uint8_t> data);
+    // returns nullopt (after printing an error) if data isn't a valid ROM
+    static std::optional<NesRom> parse(std::span<const uint8_t> data);
+};
+
+// bank number n of chr, counting in banks of size bytes. returns an empty
+// span (after printing an error) if chr doesn't have that bank
+std::span<const uint8_t> chr_bank(std::span<const uint8_t> chr, std::size_t size, std::size_t n);
+
+// number of threads used for big inputs, by default one per core.
+// set_num_threads(0) goes back to the default
+unsigned num_threads();
+unsigned set_num_threads(unsigned n);
+
+namespace detail {
+    // inputs are split among threads in blocks of at least this many strips
+    constexpr std::size_t PARALLEL_MIN_STRIPS = 256;
+    // strips decoded at once by the parallel to_indexed()
+    constexpr std::size_t PARALLEL_BATCH_STRIPS = 4096;
+
+    using DecodeFn = void (*)(const uint8_t *tiles, std::size_t num_tiles, uint8_t *out, std::size_t stride);
+    using EncodeFn = void (*)(const uint8_t *pixels, std::size_t num_tiles, std::size_t stride, uint8_t *out);
+
+    // these return nullptr (after printing an error) for invalid parameters
+    DecodeFn find_decoder(int bpp, DataMode mode);
+    EncodeFn find_encoder(std::size_t width, std::size_t height, int bpp, DataMode mode);
+
+    // decodes every strip in bytes into an image with rows stride bytes
+    // apart, using multiple threads if bytes is big enough
+    void decode_strips(DecodeFn decode, std::span<const uint8_t> bytes, int bpp, uint8_t *out, std::size_t stride);
+    // encodes every full row of tiles in an image width pixels wide, writing
+    // tiles one after the other, using multiple threads if pixels is big enough
+    void encode_rows(EncodeFn encode, std::span<const uint8_t> pixels, std::size_t width, int bpp, uint8_t *out);
+
+    // decodes a strip of up to 16 tiles, taking count bytes
+    template <typename F>
+    void decode_strip(DecodeFn decode, const uint8_t *bytes, std::size_t count, int bpp, F &draw_row)
+    {
+        // all 8 rows of pixels of these tiles are decoded at once, then
+        // handed out one at a time; each row has size equal to the width
+        // of the resulting image
+        std::array<uint8_t, ROW_SIZE * TILE_HEIGHT> rows;
+        std::size_t num_tiles = count / (bpp*8);
+        if (num_tiles < TILES_PER_ROW)
+            rows.fill(0);
+        decode(bytes, num_tiles, rows.data(), ROW_SIZE);
+        for (int r = 0; r < TILE_HEIGHT; r++)
+            draw_row(std::span{rows}.subspan(r * ROW_SIZE, ROW_SIZE));
+    }
+
+    template <typename F>
+    void to_indexed(std::span<const uint8_t> bytes, int bpp, DataMode mode, F &draw_row)
+    {
+        auto decode = find_decoder(bpp, mode);
+        if (!decode)
+            return;
+        stats::add(stats::Counter::TilesDecoded, bytes.size() / (bpp*8));
+        std::size_t strip_size = bpp*8 * TILES_PER_ROW;
+        if (bytes.size() < strip_size * PARALLEL_MIN_STRIPS * 2 || num_threads() == 1) {
+            for (std::size_t index = 0; index < bytes.size(); index += strip_size)
+                decode_strip(decode, &bytes[index], std::min(bytes.size() - index, strip_size), bpp, draw_row);
+            return;
+        }
+
+        // big inputs are decoded by multiple threads a batch at a time,
+        // then rows are handed out in order
+        std::size_t batch_size = strip_size * PARALLEL_BATCH_STRIPS;
+        HeapArray<uint8_t> rows{ROW_SIZE * TILE_HEIGHT * PARALLEL_BATCH_STRIPS};
+        for (std::size_t index = 0; index < bytes.size(); index += batch_size) {
+            auto batch = bytes.subspan(index, std::min(bytes.size() - index, batch_size));
+            decode_strips(decode, batch, bpp, rows.data(), ROW_SIZE);
+            std::size_t num_rows = (batch.size() + strip_size - 1) / strip_size * TILE_HEIGHT;
+            for (std::size_t r = 0; r < num_rows; r++)
+                draw_row(std::span{rows.data() + r * ROW_SIZE, ROW_SIZE});
+        }
+    }
+
+    // reads one strip at a time, so memory use doesn't depend on the size of
+    // the input. start has bytes already read from fp, at most a strip
+    template <typename F>
+    void to_indexed_stream(FILE *fp, int bpp, DataMode mode, F &draw_row, std::span<const uint8_t> start = {})
+    {
+        auto decode = find_decoder(bpp, mode);
+        if (!decode)
+            return;
+        std::size_t strip_size = bpp*8 * TILES_PER_ROW;
+        std::array<uint8_t, MAX_BPP*8 * TILES_PER_ROW> strip;
+        std::size_t total = 0;
+        std::size_t start_size = std::min(start.size(), strip_size);
+        std::copy(start.begin(), start.begin() + start_size, strip.begin());
+        for (;;) {
+            std::size_t count = start_size + std::fread(strip.data() + start_size, 1, strip_size - start_size, fp);
+            start_size = 0;
+            if (count == 0)
+                break;
+            total += count;
+            decode_strip(decode, strip.data(), count, bpp, draw_row);
+            if (count < strip_size)
+                break;
+        }
+        stats::add(stats::Counter::BytesRead, total);
+        stats::add(stats::Counter::TilesDecoded, total / (bpp*8));
+    }
+}
+
+// bytes is anything that can be viewed as a span of const bytes: spans,
+// vectors, HeapArrays...
+template <typename R, Sink F>
+    requires std::convertible_to<R, std::span<const uint8_t>>
+void to_indexed(R &&bytes, int bpp, DataMode mode, F &&draw_row)
+{
+    detail::to_indexed(std::span<const uint8_t>(bytes), bpp, mode, draw_row);
+}
+
+// regular files are memory mapped, anything else is streamed
+template <Sink F>
+void to_indexed(FILE *fp, int bpp, DataMode mode, F &&draw_row)
+{
+    auto data = FileData::map_file(fp);
+    if (data.mapped()) {
+        stats::add(stats::Counter::BytesRead, data.bytes().size());
+        detail::to_indexed(data.bytes(), bpp, mode, draw_row);
+    } else
+        detail::to_indexed_stream(fp, bpp, mode, draw_row);
+}
+
+template <Sink F>
+void to_chr(std::span<uint8_t> bytes, std::size_t width, std::size_t height, int bpp, DataMode mode, F &&write_data)
+{
+    auto encode = detail::find_encoder(width, height, bpp, mode);
+    if (!encode || width == 0)
+        return;
+
+    // a full row of tiles is encoded at once, then handed out one tile at a
+    // time. big images are encoded by multiple threads, many rows at a time
+    std::size_t bpt = bpp*8;
+    std::size_t num_tiles = width / TILE_WIDTH;
+    std::size_t row_size = width * TILE_HEIGHT;
+    stats::add(stats::Counter::TilesEncoded, bytes.size() / row_size * num_tiles);
+    std::size_t batch_pixels = detail::PARALLEL_BATCH_STRIPS * ROW_SIZE * TILE_HEIGHT;
+    std::size_t batch_rows = bytes.size() < 2 * detail::PARALLEL_MIN_STRIPS * ROW_SIZE * TILE_HEIGHT || num_threads() == 1
+                           ? 1 : std::max<std::size_t>(batch_pixels / row_size, 1);
+    HeapArray<uint8_t> tiles{num_tiles * bpt * batch_rows};
+    for (std::size_t j = 0; j < bytes.size(); j += row_size * batch_rows) {
+        auto batch = bytes.subspan(j, std::min(bytes.size() - j, row_size * batch_rows));
+        detail::encode_rows(encode, batch, width, bpp, tiles.data());
+        for (std::size_t i = 0; i < batch.size() / row_size * num_tiles; i++)
+            write_data(std::span{tiles.data() + i*bpt, bpt});
+    }
+}
+
+// non-template versions, kept for compatibility
 void to_indexed(std::span<uint8_t> bytes, int bpp, DataMode mode, Callback draw_row);
 void to_indexed(FILE *fp, int bpp, DataMode mode, Callback draw_row);
 void to_chr(std::span<uint8_t> bytes, std::size_t width, std::size_t height, int bpp, DataMode mode, Callback write_data);
+
+// decodes straight into an image ROW_SIZE pixels wide and img_height() tall,
+// with rows stride bytes apart. returns false if out is too small
+bool decode_into(std::span<const uint8_t> chr, std::span<uint8_t> out, std::size_t stride, int bpp, DataMode mode);
+// same as above, but also converts pixels to colors using palette. stride is in pixels
+bool decode_into(std::span<const uint8_t> chr, std::span<uint32_t> out, std::size_t stride, int bpp, DataMode mode,
+                 const Palette &palette, PixelFormat format = PixelFormat::RGBA);
+// encodes a width x height image into out, which must have room for all of its
+// tiles. tile i goes at offset i * bpp*8, same order as to_chr(). returns false
+// for invalid parameters or if out is too small
+bool encode_into(std::span<const uint8_t> pixels, std::size_t width, std::size_t height, int bpp, DataMode mode,
+                 std::span<uint8_t> out);
+
+// keeps one copy of each different tile, in order of first appearance.
+// tiles are looked up by a 64-bit hash of their encoded bytes in an open
+// addressing table. add() can be given to to_chr() to dedup as it encodes
+class TileSet {
+    std::size_t tile_size;
+    std::vector<uint8_t> data;      // the unique tiles, one after the other
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> indexes;  // UINT32_MAX = empty slot
+    int shift = 60;
+    DataMode mode;
+
+    std::size_t find_slot(uint64_t hash, const uint8_t *tile) const;
+    void grow();
+
+public:
+    // a tile as found in the set: draw tile index, flipped as said
+    struct Ref {
+        std::size_t index;
+        bool flip_x, flip_y;
+    };
+
+    // add_flipped() needs mode to find the rows and planes it flips
+    TileSet(int bpp, DataMode mode);
+
+    // returns the index of tile among the unique ones, adding it if it's new
+    std::size_t add(std::span<const uint8_t> tile);
+    // same, but a tile also matches any flipped version of itself. all four
+    // versions map to the same one, the smallest, which is added if new
+    Ref add_flipped(std::span<const uint8_t> tile);
+    std::size_t size() const                       { return data.size() / tile_size; }
+    std::span<const uint8_t> tiles() const         { return data; }
+    std::span<const uint8_t> operator[](std::size_t i) const { return std::span{data}.subspan(i * tile_size, tile_size); }
+};
+
+SimdLevel simd_level();
+SimdLevel best_simd_level();
+SimdLevel set_simd_level(SimdLevel level);
+const char *simd_level_name(SimdLevel level);
+std::optional<SimdLevel> simd_level_from_name(std::string_view name);
 long img_height(std::size_t num_bytes, int bpp);
+
+// colors found by palette_to_indexed that aren't in the palette
+struct ColorReport {
+    struct Entry {
+        ColorRGBA color;
+        std::size_t count;
+        std::size_t x, y; // first pixel with this color
+    };
+    std::vector<Entry> unmatched; // in order of first appearance
+    std::size_t total = 0;        // number of pixels with unmatched colors
+    bool stopped = false;         // true if the conversion hit max_errors
+
+    // prints a summary with the first max_colors colors, if there is anything to report
+    void print(FILE *fp, std::size_t max_colors = 8) const;
+};
+
+// pixels with colors not in palette get index 0 and are added to report.
+// with max_errors != 0, stops after finding that many of them
+HeapArray<uint8_t> palette_to_indexed(std::span<uint8_t> data, std::size_t width, const Palette &palette, int channels,
+                                      ColorReport &report, std::size_t max_errors = 0);
+// same as above, but prints the report
 HeapArray<uint8_t> palette_to_indexed(std::span<uint8_t> data, const Palette &palette, int channels);
+// maps every pixel to the palette color that looks closest to it. with dither,
+// ordered dithering approximates colors that fall between palette colors
+HeapArray<uint8_t> quantize_to_indexed(std::span<uint8_t> data, std::size_t width, const Palette &palette, int channels,
+                                       bool dither = false);
 HeapArray<ColorRGBA> indexed_to_palette(std::span<uint8_t> data, const Palette &palette);
 
 } // namespace chr
@@ -2,26 +2,24 @@
 #include <cstdint>
 #include <cassert>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
 #include <span>
 #include <string>
+#include <thread>
+#include <vector>
 #include <optional>
 #include <charconv>
 #include <string_view>
 #include <fmt/core.h>
-#include <CImg.h>
-#include "stb_image.h"
 #include "chr.hpp"
-#undef None
+#include "png.hpp"
+#include "convert.hpp"
 #include "cmdline.hpp"
 
-long filesize(FILE *f)
-{
-    fseek(f, 0, SEEK_END);
-    long res = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    return res;
-}
-
 template <typename T = int>
 std::optional<T> _conv(const char *start, const char *end, unsigned base = 10)
 {
@@ -39,64 +37,101 @@ std::optional<T> strconv(const TStr &str, unsigned base = 10)
     return _conv<T>(str.data(), str.data() + str.size(), base);
 }
 
-int image_to_chr(const char *input, const char *output, int bpp, chr::DataMode mode)
+// replaces {dir}, {name} and {ext} in an output filename with the parts of
+// the input filename, e.g. for "gfx/font.chr": "gfx", "font" and "chr"
+std::string expand_output_name(std::string_view tmpl, std::string_view input)
 {
-    int width, height, channels;
-    unsigned char *img_data = stbi_load(input, &width, &height, &channels, 0);
-    if (!img_data) {
-        fmt::print(stderr, "error: couldn't load image {}\n", input);
-        return 1;
+    std::filesystem::path path{input};
+    std::string dir = path.parent_path().string();
+    std::string ext = path.extension().string();
+    const std::pair<std::string_view, std::string> vars[] = {
+        { "{dir}",  dir.empty() ? "." : dir },
+        { "{name}", path.stem().string() },
+        { "{ext}",  ext.empty() ? "" : ext.substr(1) },
+    };
+    std::string result;
+    for (std::size_t i = 0; i < tmpl.size(); ) {
+        auto var = std::find_if(std::begin(vars), std::end(vars), [&](const auto &v) { return tmpl.substr(i).starts_with(v.first); });
+        if (var != std::end(vars)) {
+            result += var->second;
+            i += var->first.size();
+        } else
+            result += tmpl[i++];
     }
+    return result;
+}
 
-    FILE *out = fopen(output, "w");
-    if (!out) {
-        fmt::print(stderr, "error: couldn't write to {}\n", output);
-        std::perror("");
-        return 1;
+// one filename per line; empty lines and lines starting with # are skipped
+bool read_manifest(const char *filename, std::vector<std::string> &inputs)
+{
+    std::ifstream file{filename};
+    if (!file) {
+        fmt::print(stderr, "error: couldn't open file list {}\n", filename);
+        return false;
     }
-
-    chr::Palette pal{bpp};
-    auto tmp = std::span(img_data, width*height*channels);
-    auto data = chr::palette_to_indexed(tmp, pal, channels);
-    chr::to_chr(data, width, height, bpp, mode, [&](std::span<uint8_t> tile) {
-        fwrite(tile.data(), 1, tile.size(), out);
-    });
-
-    fclose(out);
-    return 0;
+    for (std::string line; std::getline(file, line); ) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty() && line[0] != '#')
+            inputs.push_back(line);
+    }
+    return true;
 }
 
-int chr_to_image(const char *input, const char *output, int bpp, chr::DataMode mode)
+// converts every input with convert(input, output) on num_workers threads.
+// each thread takes the next file still to be done, so slow files don't
+// hold up the others. prints the outcome and time of each file as it ends
+template <typename F>
+int run_batch(const std::vector<std::string> &inputs, std::string_view output_tmpl, unsigned num_workers, F &&convert)
 {
-    FILE *f = fopen(input, "r");
-    if (!f) {
-        fmt::print(stderr, "error: couldn't open file {}: ", input);
-        std::perror("");
-        return 1;
-    }
+    using clock = std::chrono::steady_clock;
+    auto ms_since = [](clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    };
 
-    size_t height = chr::img_height(filesize(f), bpp);
-    cimg_library::CImg<unsigned char> img(16 * 8, height, 1, 4);
-    int y = 0;
-
-    img.fill(0);
-    chr::Palette palette{bpp};
-    chr::to_indexed(f, bpp, mode, [&](std::span<uint8_t> row)
-    {
-        for (int x = 0; x < 128; x++) {
-            const auto color = palette[row[x]];
-            img(x, y, 0) = color.red();
-            img(x, y, 1) = color.green();
-            img(x, y, 2) = color.blue();
-            img(x, y, 3) = 0xFF;
+    auto start = clock::now();
+    std::atomic<std::size_t> next = 0, done = 0, failed = 0;
+    std::mutex print_mutex;
+    auto work = [&] {
+        for (std::size_t i; (i = next++) < inputs.size(); ) {
+            auto output = expand_output_name(output_tmpl, inputs[i]);
+            auto file_start = clock::now();
+            int res = convert(inputs[i].c_str(), output.c_str());
+            double time = ms_since(file_start);
+            if (res != 0)
+                failed++;
+            std::lock_guard lock{print_mutex};
+            fmt::print(stderr, "[{:>{}}/{}] {:<4} {:>9.2f} ms  {} -> {}\n",
+                       ++done, fmt::formatted_size("{}", inputs.size()), inputs.size(),
+                       res == 0 ? "ok" : "FAIL", time, inputs[i], output);
         }
-        y++;
-    });
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < num_workers; i++)
+        workers.emplace_back(work);
+    work();
+    for (auto &w : workers)
+        w.join();
 
-    img.save_png(output);
-    fclose(f);
+    fmt::print(stderr, "{} files, {} converted, {} failed in {:.2f} ms\n",
+               inputs.size(), inputs.size() - failed, failed.load(), ms_since(start));
+    return failed == 0 ? 0 : 1;
+}
 
-    return 0;
+// parses SIZE:NUMBER, with SIZE one of 1k, 4k or 8k
+bool parse_bank(std::string_view arg, DecodeOptions &opts)
+{
+    auto colon = arg.find(':');
+    if (colon == arg.npos)
+        return false;
+    auto size = arg.substr(0, colon);
+    auto num = strconv<std::size_t>(arg.substr(colon + 1));
+    if (!num)
+        return false;
+    opts.bank_size = size == "1k" ? 1024 : size == "4k" ? 4096 : size == "8k" ? 8192 : 0;
+    opts.bank = num.value();
+    return opts.bank_size != 0;
 }
 
 bool select_mode(std::string_view arg, int &bpp, chr::DataMode &mode)
@@ -118,17 +153,35 @@ using cmdline::ParamType;
 
 static const cmdline::ArgumentList arglist = {
     { 'h', "help",      "show this help text"                                         },
-    { 'o', "output",    "FILENAME: output to FILENAME",             ParamType::Single },
+    { 'o', "output",    "FILENAME: output to FILENAME (- for standard output). {dir}, {name} and {ext} "
+                        "are replaced with parts of the input filename", ParamType::Single },
     { 'r', "reverse",   "convert from image to chr"                                   },
     { 'b', "bpp",       "NUMBER: specify bpp (bits per pixel)",     ParamType::Single },
     { 'd', "data-mode", "(planar | interwined): specify data mode", ParamType::Single },
     { 'm', "mode",      "(nes | snes): specify mode",               ParamType::Single },
+    { 'x', "simd",      "(scalar | sse2 | ssse3 | avx2 | avx512): force instruction set", ParamType::Single },
+    { 'j', "jobs",      "NUMBER: number of threads to use (default: one per core)", ParamType::Single },
+    { 'k', "bank",      "SIZE:NUMBER: only convert bank NUMBER, counting in banks of SIZE (1k, 4k or 8k)", ParamType::Single },
+    { 'z', "zlib-level", "NUMBER: PNG compression level, 0-9 (default 6)", ParamType::Single },
+    { 'f', "filter",    "(none | sub | up | average | paeth | adaptive): PNG row filter (default none)", ParamType::Single },
+    { 'l', "list",      "FILENAME: convert the files listed in FILENAME, one per line", ParamType::Single },
+    { 'e', "max-errors", "NUMBER: give up after NUMBER pixels with colors not in the palette", ParamType::Single },
+    { 'q', "quantize",  "with -r, map colors not in the palette to the closest one" },
+    { 'D', "dither",    "with -q, use ordered dithering"                              },
+    { 't', "tilemap",   "FILENAME: with -r, write each different tile once and the tilemap to FILENAME "
+                        "(16-bit indexes); {dir}, {name} and {ext} work as in -o", ParamType::Single },
+    { 'F', "flips",     "with -t, also match tiles flipped horizontally or vertically (bits 14 and 15 of tilemap entries)" },
+    { 's', "stats",     "print the time of each step and how much data went through, at the end" },
+    { 'S', "stats-json", "FILENAME: write the same statistics to FILENAME as JSON", ParamType::Single },
 };
 
 int main(int argc, char *argv[])
 {
     auto usage = []() {
-        fmt::print(stderr, "usage: chrconvert [file...]\n");
+        fmt::print(stderr, "usage: chrconvert [file...] (use - for standard input)\n"
+                           "CHR-ROM is taken directly from .nes files\n"
+                           "with more than one file, they are converted in parallel to {{dir}}/{{name}}.png\n"
+                           "(or .chr), unless -o says otherwise\n");
         cmdline::print_args(arglist, stderr);
     };
 
@@ -138,8 +191,10 @@ int main(int argc, char *argv[])
     }
 
     enum class Mode { TOIMG, TOCHR } mode = Mode::TOIMG;
-    const char *input = NULL, *output = NULL;
+    const char *output = NULL;
     int bpp = 2;
+    EncodeOptions encode_opts;
+    DecodeOptions decode_opts;
     chr::DataMode datamode = chr::DataMode::Planar;
 
     auto result = cmdline::parse(argc, argv, arglist);
@@ -174,14 +229,126 @@ int main(int argc, char *argv[])
             fmt::print(stderr, "warning: invalid mode (defaults will be used)\n");
     }
 
-    if (result.items.size() == 0) {
+    if (result.has['x']) {
+        auto level = chr::simd_level_from_name(result.params['x']);
+        if (!level)
+            fmt::print(stderr, "warning: invalid argument {} for -x (best available will be used)\n", result.params['x']);
+        else if (chr::set_simd_level(level.value()) != level.value())
+            fmt::print(stderr, "warning: {} not supported by this CPU ({} will be used)\n",
+                       result.params['x'], chr::simd_level_name(chr::simd_level()));
+    }
+
+    if (result.has['k'] && !parse_bank(result.params['k'], decode_opts)) {
+        fmt::print(stderr, "error: invalid argument {} for -k\n", result.params['k']);
+        return 1;
+    }
+
+    if (result.has['z']) {
+        auto num = strconv(result.params['z']);
+        if (!num || num.value() < 0 || num.value() > 9)
+            fmt::print(stderr, "warning: invalid value {} for -z (default of 6 will be used)\n", result.params['z']);
+        else
+            decode_opts.png.level = num.value();
+    }
+    if (result.has['f']) {
+        auto filter = png::filter_from_name(result.params['f']);
+        if (!filter)
+            fmt::print(stderr, "warning: invalid argument {} for -f (no filter will be used)\n", result.params['f']);
+        else
+            decode_opts.png.filter = filter.value();
+    }
+
+    if (result.has['j']) {
+        auto num = strconv<unsigned>(result.params['j']);
+        if (!num)
+            fmt::print(stderr, "warning: invalid value {} for -j (one thread per core will be used)\n", result.params['j']);
+        else
+            chr::set_num_threads(num.value());
+    }
+
+    if (result.has['e']) {
+        auto num = strconv<std::size_t>(result.params['e']);
+        if (!num)
+            fmt::print(stderr, "warning: invalid value {} for -e (no limit will be used)\n", result.params['e']);
+        else
+            encode_opts.max_errors = num.value();
+    }
+    encode_opts.quantize = result.has['q'];
+    encode_opts.dither = result.has['D'];
+    encode_opts.flips = result.has['F'];
+
+    std::vector<std::string> inputs{result.items.begin(), result.items.end()};
+    if (result.has['l'] && !read_manifest(result.params['l'].data(), inputs))
+        return 1;
+    if (inputs.size() == 0) {
         fmt::print(stderr, "error: no file specified\n");
         usage();
         return 1;
-    } else if (result.items.size() > 1)
-        fmt::print(stderr, "error: too many files specified (only first will be used)\n");
-    input = result.items[0].data();
+    }
 
-    return mode == Mode::TOIMG ? chr_to_image(input, output ? output : "output.png", bpp, datamode)
-                               : image_to_chr(input, output ? output : "output.chr", bpp, datamode);
+    // the JSON would end up in the middle of the other output
+    auto is_stdout = [&](char c) { return result.has[c] && is_std_stream(result.params[c].data()); };
+    if (is_stdout('S') && (is_stdout('o') || is_stdout('t'))) {
+        fmt::print(stderr, "error: -S - can't be used with -o - or -t -\n");
+        return 1;
+    }
+    if ((result.has['s'] || result.has['S']) && !chr::stats::enabled)
+        fmt::print(stderr, "warning: statistics were disabled at build time\n");
+    auto start = std::chrono::steady_clock::now();
+    auto print_stats = [&](int res) {
+        auto snapshot = chr::stats::snapshot();
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (result.has['s'])
+            chr::stats::print(stderr, snapshot, wall);
+        if (result.has['S']) {
+            FILE *fp = is_std_stream(result.params['S'].data()) ? stdout : fopen(result.params['S'].data(), "w");
+            if (!fp) {
+                fmt::print(stderr, "error: couldn't write statistics to {}: ", result.params['S']);
+                std::perror("");
+                return 1;
+            }
+            chr::stats::print_json(fp, snapshot, wall);
+            if (fp != stdout)
+                fclose(fp);
+        }
+        return res;
+    };
+
+    std::string_view tilemap_tmpl = result.has['t'] ? result.params['t'] : "";
+    auto convert = [&](const char *input, const char *output) {
+        if (mode == Mode::TOIMG)
+            return chr_to_image(input, output, bpp, datamode, decode_opts);
+        auto opts = encode_opts;
+        std::string tilemap;
+        if (!tilemap_tmpl.empty()) {
+            tilemap = expand_output_name(tilemap_tmpl, input);
+            opts.tilemap = tilemap.c_str();
+        }
+        return image_to_chr(input, output, bpp, datamode, opts);
+    };
+
+    if (inputs.size() == 1) {
+        auto name = output ? expand_output_name(output, inputs[0])
+                           : mode == Mode::TOIMG ? "output.png" : "output.chr";
+        return print_stats(convert(inputs[0].c_str(), name.c_str()));
+    }
+
+    if (std::find_if(inputs.begin(), inputs.end(), [](const auto &s) { return is_std_stream(s.c_str()); }) != inputs.end()) {
+        fmt::print(stderr, "error: standard input can't be used with more than one file\n");
+        return 1;
+    }
+    if (output && std::string_view{output}.find("{name}") == std::string_view::npos) {
+        fmt::print(stderr, "error: -o must contain {{name}} when converting more than one file\n");
+        return 1;
+    }
+    if (!tilemap_tmpl.empty() && tilemap_tmpl.find("{name}") == std::string_view::npos) {
+        fmt::print(stderr, "error: -t must contain {{name}} when converting more than one file\n");
+        return 1;
+    }
+    // files are already spread among threads, so each one is converted on
+    // a single thread
+    unsigned num_workers = std::min<std::size_t>(chr::num_threads(), inputs.size());
+    chr::set_num_threads(1);
+    return print_stats(run_batch(inputs, output ? output : mode == Mode::TOIMG ? "{dir}/{name}.png" : "{dir}/{name}.chr",
+                                 num_workers, convert));
 }
@@ -1,5 +1,6 @@
 #include "cmdline.hpp"
 
+#include <algorithm>
 #include <fmt/core.h>
 // #include <emu/util/debug.hpp>
 
@@ -8,7 +9,7 @@ namespace cmdline {
 constexpr inline void warning(std::string_view fmtstr, auto&&... args)
 {
     fmt::print(stderr, "warning: ");
-    fmt::print(stderr, fmtstr, args...);
+    fmt::vprint(stderr, fmtstr, fmt::make_format_args(args...));
 }
 
 auto find_arg(std::string_view arg, const ArgumentList &list) { return std::find_if(list.begin(), list.end(), [&](const auto &a) { return a.long_opt  == arg; }); }
@@ -20,7 +21,8 @@ Result parse(const std::vector<std::string_view> &args, const ArgumentList &vali
     for (auto it = args.begin()+1, it2 = args.begin()+2; it != args.end(); ++it, ++it2) {
         std::string_view curr = *it;
 
-        if (curr[0] != '-') {
+        // a lone "-" usually means standard input, so it's an item too
+        if (curr[0] != '-' || curr.size() == 1) {
             res.items.push_back(curr);
             continue;
         }
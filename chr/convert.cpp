@@ -0,0 +1,276 @@
+#include "convert.hpp"
+
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <span>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+#include "stb_image.h"
+
+using chr::stats::Phase;
+
+namespace {
+    // laps the stats timer and, if there's a PhaseTimes, adds to it too.
+    // benchmarks need those times even when stats are compiled out, so
+    // they're measured separately
+    class PhaseTimer {
+        static constexpr std::array<double PhaseTimes::*, chr::stats::NUM_PHASES> fields = {
+            &PhaseTimes::load, &PhaseTimes::decode, &PhaseTimes::palettize, &PhaseTimes::encode, &PhaseTimes::write,
+        };
+        chr::stats::Timer stats;
+        PhaseTimes *times;
+        double last;
+
+    public:
+        explicit PhaseTimer(PhaseTimes *times)
+            : times(times), last(times ? chr::stats::clock_seconds() : 0)
+        { }
+
+        void lap(Phase phase)
+        {
+            stats.lap(phase);
+            if (!times)
+                return;
+            double now = chr::stats::clock_seconds();
+            times->*fields[static_cast<int>(phase)] += now - last;
+            last = now;
+        }
+    };
+}
+
+bool is_std_stream(const char *filename)
+{
+    return std::string_view(filename) == "-";
+}
+
+bool remap_indexes(png::IndexedImage &img, const chr::Palette &palette)
+{
+    std::array<int, 256> remap;
+    remap.fill(-1);
+    bool same = true;
+    for (std::size_t i = 0; i < img.palette.size(); i++) {
+        remap[i] = palette.find_color(img.palette[i]);
+        same = same && remap[i] == int(i);
+    }
+    if (same) {
+        auto max = std::max_element(img.pixels.begin(), img.pixels.end());
+        return max == img.pixels.end() || *max < img.palette.size();
+    }
+    for (auto &p : img.pixels) {
+        if (remap[p] == -1)
+            return false;
+        p = remap[p];
+    }
+    return true;
+}
+
+int image_to_chr(const char *input, const char *output, int bpp, chr::DataMode mode, const EncodeOptions &opts,
+                 PhaseTimes *times)
+{
+    PhaseTimer timer{times};
+    FILE *f = is_std_stream(input) ? stdin : fopen(input, "rb");
+    if (!f) {
+        fmt::print(stderr, "error: couldn't open file {}: ", input);
+        std::perror("");
+        return 1;
+    }
+    chr::FileData file{f};
+    if (f != stdin)
+        fclose(f);
+    timer.lap(Phase::Load);
+
+    // indexed PNGs already have the indexes, as long as their palette has
+    // the same colors. anything else is expanded to colors and looked up
+    chr::Palette pal{bpp};
+    std::size_t width, height;
+    chr::HeapArray<uint8_t> data;
+    auto indexed = opts.quantize ? std::nullopt : png::read_indexed(file.bytes());
+    timer.lap(Phase::Decode);
+    if (indexed && remap_indexes(*indexed, pal)) {
+        width = indexed->width;
+        height = indexed->height;
+        data = std::move(indexed->pixels);
+        timer.lap(Phase::Palettize);
+    } else {
+        int w, h, channels;
+        unsigned char *img_data = stbi_load_from_memory(file.bytes().data(), file.bytes().size(), &w, &h, &channels, 0);
+        if (!img_data) {
+            fmt::print(stderr, "error: couldn't load image {}\n", input);
+            return 1;
+        }
+        timer.lap(Phase::Decode);
+        width = w;
+        height = h;
+        chr::ColorReport report;
+        auto tmp = std::span(img_data, width*height*channels);
+        data = opts.quantize ? chr::quantize_to_indexed(tmp, width, pal, channels, opts.dither)
+                             : chr::palette_to_indexed(tmp, width, pal, channels, report, opts.max_errors);
+        stbi_image_free(img_data);
+        timer.lap(Phase::Palettize);
+        report.print(stderr);
+        if (report.stopped) {
+            fmt::print(stderr, "error: too many pixels with colors not present in palette\n");
+            return 1;
+        }
+    }
+
+    chr::HeapArray<uint8_t> tiles{width * height / 64 * bpp*8};
+    if (!chr::encode_into(data, width, height, bpp, mode, tiles))
+        return 1;
+    std::span<const uint8_t> result = tiles;
+    chr::TileSet unique{bpp, mode};
+    std::vector<uint8_t> tilemap;
+    if (opts.tilemap) {
+        tilemap.resize(tiles.size() / (bpp*8) * 2);
+        for (std::size_t i = 0; i < tiles.size() / (bpp*8); i++) {
+            auto tile = std::span{tiles.data() + i * bpp*8, std::size_t(bpp*8)};
+            std::size_t entry;
+            if (opts.flips) {
+                auto ref = unique.add_flipped(tile);
+                entry = ref.index | ref.flip_x << 14 | ref.flip_y << 15;
+            } else
+                entry = unique.add(tile);
+            tilemap[i*2 + 0] = entry & 0xFF;
+            tilemap[i*2 + 1] = entry >> 8 & 0xFF;
+        }
+        std::size_t max_tiles = opts.flips ? 0x4000 : 0x10000;
+        if (unique.size() > max_tiles) {
+            fmt::print(stderr, "error: {} has {} different tiles, but the tilemap can only refer to {}\n",
+                       input, unique.size(), max_tiles);
+            return 1;
+        }
+        result = unique.tiles();
+    }
+    timer.lap(Phase::Encode);
+
+    FILE *out = is_std_stream(output) ? stdout : fopen(output, "wb");
+    if (!out) {
+        fmt::print(stderr, "error: couldn't write to {}\n", output);
+        std::perror("");
+        return 1;
+    }
+
+    fwrite(result.data(), 1, result.size(), out);
+    chr::stats::add(chr::stats::Counter::BytesWritten, result.size());
+
+    if (out != stdout)
+        fclose(out);
+
+    if (opts.tilemap) {
+        FILE *map = is_std_stream(opts.tilemap) ? stdout : fopen(opts.tilemap, "wb");
+        if (!map) {
+            fmt::print(stderr, "error: couldn't write to {}: ", opts.tilemap);
+            std::perror("");
+            return 1;
+        }
+        fwrite(tilemap.data(), 1, tilemap.size(), map);
+        chr::stats::add(chr::stats::Counter::BytesWritten, tilemap.size());
+        if (map != stdout)
+            fclose(map);
+    }
+    timer.lap(Phase::Write);
+    chr::stats::add(chr::stats::Counter::Files, 1);
+    return 0;
+}
+
+int chr_to_image(const char *input, const char *output, int bpp, chr::DataMode mode, const DecodeOptions &opts,
+                 PhaseTimes *times)
+{
+    PhaseTimer timer{times};
+    FILE *f = is_std_stream(input) ? stdin : fopen(input, "rb");
+    if (!f) {
+        fmt::print(stderr, "error: couldn't open file {}: ", input);
+        std::perror("");
+        return 1;
+    }
+
+    // regular files are mapped. pipes are decoded a strip at a time as they're
+    // read, so that memory use doesn't grow with them, unless they hold a ROM
+    // or only a bank is wanted. the first bytes tell if it's a ROM
+    auto data = chr::FileData::map_file(f);
+    std::array<uint8_t, 16> head;
+    std::size_t head_size = 0;
+    bool stream = false;
+    if (data.mapped())
+        chr::stats::add(chr::stats::Counter::BytesRead, data.bytes().size());
+    else {
+        head_size = std::fread(head.data(), 1, head.size(), f);
+        stream = opts.bank_size == 0 && !chr::NesRom::is_rom(std::span{head}.first(head_size));
+        if (!stream)
+            data = chr::FileData{f, std::span{head}.first(head_size)};
+    }
+    if (!stream && f != stdin)
+        fclose(f);
+    // closes f once a stream has been decoded, or on errors
+    auto close_input = [&] {
+        if (stream && f != stdin)
+            fclose(f);
+    };
+
+    // ROMs are decoded straight from the file's memory
+    auto bytes = data.bytes();
+    if (chr::NesRom::is_rom(bytes)) {
+        auto rom = chr::NesRom::parse(bytes);
+        if (!rom)
+            return 1;
+        if (rom->chr.empty()) {
+            fmt::print(stderr, "error: {} has no CHR-ROM (mapper {} uses CHR-RAM)\n", input, rom->mapper);
+            return 1;
+        }
+        bytes = rom->chr;
+    }
+    if (opts.bank_size != 0) {
+        bytes = chr::chr_bank(bytes, opts.bank_size, opts.bank);
+        if (bytes.empty())
+            return 1;
+    }
+    timer.lap(Phase::Load);
+
+    FILE *out = is_std_stream(output) ? stdout : fopen(output, "wb");
+    if (!out) {
+        fmt::print(stderr, "error: couldn't write to {}: ", output);
+        std::perror("");
+        close_input();
+        return 1;
+    }
+    timer.lap(Phase::Write);
+
+    // rows are compressed as soon as they're decoded. the height of streams
+    // is only known at the end, which the writer takes care of
+    png::IndexedWriter writer;
+    bool ok = writer.start(out, chr::ROW_SIZE, stream ? 0 : chr::img_height(bytes.size(), bpp), bpp,
+                           chr::Palette{bpp}, opts.png);
+    timer.lap(Phase::Encode);
+    if (ok) {
+        // a strip of tiles is decoded before its first row comes, so
+        // laps at strip boundaries split decoding from compression.
+        // for streams, decoding includes reading
+        std::size_t num_rows = 0;
+        auto draw_row = [&](std::span<uint8_t> row) {
+            if (num_rows % chr::TILE_HEIGHT == 0)
+                timer.lap(Phase::Decode);
+            writer.write_row(row);
+            if (++num_rows % chr::TILE_HEIGHT == 0)
+                timer.lap(Phase::Encode);
+        };
+        if (stream)
+            chr::detail::to_indexed_stream(f, bpp, mode, draw_row, std::span{head}.first(head_size));
+        else
+            chr::to_indexed(bytes, bpp, mode, draw_row);
+        ok = writer.finish();
+        timer.lap(Phase::Encode);
+    }
+    close_input();
+    if (out != stdout)
+        fclose(out);
+    timer.lap(Phase::Write);
+    if (!ok) {
+        fmt::print(stderr, "error: couldn't write image {}\n", output);
+        return 1;
+    }
+    chr::stats::add(chr::stats::Counter::Files, 1);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include "chr.hpp"
+#include "png.hpp"
+
+// Whole-file conversions, as done by chrconvert.
+
+// options for converting images to chr
+struct EncodeOptions {
+    std::size_t max_errors = 0;
+    bool quantize = false;
+    bool dither = false;
+    // if set, each different tile is written once and this file gets the
+    // tilemap: one little endian 16-bit tile index per tile, row by row
+    const char *tilemap = nullptr;
+    // tiles also match flipped versions of others. indexes in the tilemap
+    // take 14 bits, bits 14 and 15 flip the tile horizontally and vertically
+    bool flips = false;
+};
+
+// options for converting chr to images
+struct DecodeOptions {
+    std::size_t bank_size = 0; // 0 = whole file
+    std::size_t bank = 0;
+    png::WriteOptions png;
+};
+
+// seconds spent in each step of a conversion. times are added to what's
+// already there, so that many conversions can be summed up
+struct PhaseTimes {
+    double load = 0;      // opening and reading the input
+    double decode = 0;    // PNG decoding, or chr to palette indexes
+    double palettize = 0; // colors to palette indexes (images only)
+    double encode = 0;    // palette indexes to chr, or PNG compression
+    double write = 0;     // opening and writing the output
+    // PNGs are written as they're compressed, so for chr_to_image encode
+    // includes most of the writing and write only opening and flushing
+
+    double total() const { return load + decode + palettize + encode + write; }
+};
+
+// "-" stands for standard input/output
+bool is_std_stream(const char *filename);
+
+// turns the indexes of an indexed PNG into indexes of palette, unless they
+// already are the same. returns false if a pixel has a color not in palette
+bool remap_indexes(png::IndexedImage &img, const chr::Palette &palette);
+
+// both return 0 on success and 1 after printing an error.
+// if times isn't null, the time of each step is added to it
+int image_to_chr(const char *input, const char *output, int bpp, chr::DataMode mode, const EncodeOptions &opts,
+                 PhaseTimes *times = nullptr);
+int chr_to_image(const char *input, const char *output, int bpp, chr::DataMode mode, const DecodeOptions &opts,
+                 PhaseTimes *times = nullptr);
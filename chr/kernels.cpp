@@ -0,0 +1,118 @@
+#include "kernels.hpp"
+
+#include <bit>
+#include <cstring>
+
+using u8 = uint8_t;
+
+namespace chr::kernels {
+
+namespace {
+    // spreads the 8 bits of a plane byte into 8 bytes, one for each pixel,
+    // leftmost pixel first. each byte is either 0 or 1, so a pixel's full
+    // value can be built by shifting the spread of plane i by i and OR'ing.
+    constexpr std::array<uint64_t, 256> make_spread_table()
+    {
+        std::array<uint64_t, 256> table;
+        for (unsigned byte = 0; byte < 256; byte++) {
+            uint64_t spread = 0;
+            for (unsigned col = 0; col < 8; col++) {
+                unsigned shift = std::endian::native == std::endian::little ? col*8 : (7-col)*8;
+                spread |= uint64_t(byte >> (7-col) & 1) << shift;
+            }
+            table[byte] = spread;
+        }
+        return table;
+    }
+
+    constexpr auto spread_table = make_spread_table();
+
+    template <int BPP, DataMode Mode>
+    struct TileCodec {
+        static void decode(const uint8_t *tiles, std::size_t num_tiles, uint8_t *out, std::size_t stride)
+        {
+            for (std::size_t t = 0; t < num_tiles; t++) {
+                const u8 *tile = tiles + t*BPP*8;
+                for (int row = 0; row < 8; row++) {
+                    uint64_t pixels = 0;
+                    for (int i = 0; i < BPP; i++)
+                        pixels |= spread_table[tile[plane_offset<BPP, Mode>(row, i)]] << i;
+                    std::memcpy(out + row*stride + t*8, &pixels, sizeof(pixels));
+                }
+            }
+        }
+
+        static void encode(const uint8_t *pixels, std::size_t num_tiles, std::size_t stride, uint8_t *out)
+        {
+            for (std::size_t t = 0; t < num_tiles; t++) {
+                u8 *tile = out + t*BPP*8;
+                for (int row = 0; row < 8; row++) {
+                    const u8 *p = pixels + row*stride + t*8;
+                    for (int i = 0; i < BPP; i++) {
+                        u8 byte = 0;
+                        for (int c = 0; c < 8; c++)
+                            byte |= (p[c] >> i & 1) << (7-c);
+                        tile[plane_offset<BPP, Mode>(row, i)] = byte;
+                    }
+                }
+            }
+        }
+    };
+}
+
+constexpr CodecTable scalar_codecs = make_codec_table<TileCodec>();
+
+void palettize_scalar(const uint8_t *pixels, std::size_t n, const uint32_t *lut, int colors, uint32_t *out)
+{
+    for (std::size_t i = 0; i < n; i++)
+        out[i] = lut[pixels[i]];
+}
+
+namespace {
+    // squared distance between two pairs of components
+    inline int32_t distance2(uint32_t a, uint32_t b)
+    {
+        int32_t d0 = int16_t(a) - int16_t(b);
+        int32_t d1 = int16_t(a >> 16) - int16_t(b >> 16);
+        return d0*d0 + d1*d1;
+    }
+}
+
+int nearest_scalar(const uint32_t *pal0, const uint32_t *pal1, std::size_t n, uint32_t color0, uint32_t color1)
+{
+    int best = 0;
+    int32_t best_dist = INT32_MAX;
+    for (std::size_t i = 0; i < n; i++) {
+        int32_t dist = distance2(pal0[i], color0) + distance2(pal1[i], color1);
+        if (dist < best_dist) {
+            best_dist = dist;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// x86 has its own versions of these in kernels_x86.cpp
+#if !defined(__x86_64__) && !defined(__i386__)
+SimdLevel detect_simd_level()
+{
+    return SimdLevel::Scalar;
+}
+
+const CodecTable &codec_table(SimdLevel level)
+{
+    return scalar_codecs;
+}
+
+PalettizeFn palettize_kernel(SimdLevel level)
+{
+    return palettize_scalar;
+}
+
+NearestFn nearest_kernel(SimdLevel level)
+{
+    return nearest_scalar;
+}
+#endif
+
+} // namespace chr::kernels
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include "chr.hpp"
+
+// Internal tile kernels used by chr.cpp. They aren't part of the public API.
+// A decoding kernel converts a run of consecutive tiles and writes them side
+// by side: row r of tile t ends up at out[r*stride + t*8]. An encoding kernel
+// does the opposite, reading pixels laid out the same way and writing the
+// encoded tiles one after the other.
+// Kernels are specialized for every (bpp, data mode) pair, so that nothing
+// inside them depends on runtime values other than the number of tiles.
+namespace chr::kernels {
+
+// position inside a tile of the byte holding the bits of plane i for a given row
+template <int BPP, DataMode Mode>
+constexpr int plane_offset(int row, int i)
+{
+    if constexpr(Mode == DataMode::Planar)
+        return row + i*8;
+    // the last plane of an odd bpp isn't paired with another
+    return i == BPP-1 && BPP % 2 != 0 ? i/2*16 + row
+                                      : i/2*16 + row*2 + i%2;
+}
+
+using DecodeFn = detail::DecodeFn;
+using EncodeFn = detail::EncodeFn;
+
+struct Codec {
+    DecodeFn decode;
+    EncodeFn encode;
+};
+
+using CodecTable = std::array<Codec, 16>;
+
+// maps n pixels to colors through lut. every pixel is known to be less than colors
+using PalettizeFn = void (*)(const uint8_t *pixels, std::size_t n, const uint32_t *lut, int colors, uint32_t *out);
+
+// returns the index of the palette entry nearest to a color. colors are made
+// of four 16-bit components packed in pairs into two words: entry i of the
+// palette is (pal0[i], pal1[i]) and n is a multiple of 16. only integer math
+// is used, so every kernel returns the same entry, the first on ties
+using NearestFn = int (*)(const uint32_t *pal0, const uint32_t *pal1, std::size_t n, uint32_t color0, uint32_t color1);
+
+inline std::size_t codec_index(int bpp, DataMode mode)
+{
+    return (bpp-1)*2 + (mode == DataMode::Interwined);
+}
+
+// builds a table with every instantiation of TileCodec, which must have static
+// decode and encode functions matching DecodeFn and EncodeFn
+template <template <int, DataMode> typename TileCodec>
+constexpr CodecTable make_codec_table()
+{
+    return []<std::size_t... I>(std::index_sequence<I...>) {
+        return CodecTable{
+            Codec{ TileCodec<I/2 + 1, I%2 == 0 ? DataMode::Planar : DataMode::Interwined>::decode,
+                   TileCodec<I/2 + 1, I%2 == 0 ? DataMode::Planar : DataMode::Interwined>::encode }...
+        };
+    }(std::make_index_sequence<16>{});
+}
+
+extern const CodecTable scalar_codecs;
+
+#if defined(__x86_64__) || defined(__i386__)
+// sse2_codecs and ssse3_codecs have no decoder for the bpp values where the
+// scalar one is faster; codec_table() fills those in
+extern const CodecTable sse2_codecs;
+extern const CodecTable ssse3_codecs;
+extern const CodecTable avx2_codecs;
+extern const CodecTable avx512_codecs;
+#endif
+
+// best level supported by the CPU we're running on
+SimdLevel detect_simd_level();
+// kernels for a level, which must be supported by the CPU
+const CodecTable &codec_table(SimdLevel level);
+PalettizeFn palettize_kernel(SimdLevel level);
+NearestFn nearest_kernel(SimdLevel level);
+
+void palettize_scalar(const uint8_t *pixels, std::size_t n, const uint32_t *lut, int colors, uint32_t *out);
+int nearest_scalar(const uint32_t *pal0, const uint32_t *pal1, std::size_t n, uint32_t color0, uint32_t color1);
+
+} // namespace chr::kernels
@@ -0,0 +1,579 @@
+#include "kernels.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cstring>
+#include <immintrin.h>
+
+// GCC 12 warns about its own AVX-512 intrinsics (GCC bug 105593)
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// These kernels are compiled with target attributes rather than global
+// -m flags, so that the rest of the program keeps running on any x86 CPU.
+// Which ones actually get used is decided at runtime (see codec_table()).
+#define TARGET_SSE2   __attribute__((target("sse2")))
+#define TARGET_SSSE3  __attribute__((target("ssse3")))
+#define TARGET_AVX2   __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+using u8 = uint8_t;
+
+namespace chr::kernels {
+
+namespace {
+    // Decoding a tile is an 8x8 bit matrix transpose for each plane: every
+    // plane contributes 8 row bytes, and bit 7-c of a row byte belongs to
+    // column c. Each row byte gets broadcast to 8 lanes, then the lanes are
+    // tested against a mask selecting a different bit for each column.
+
+    // 0x80, 0x40, ..., 0x01 for every 8 bytes: selects the bit for each column
+    const int64_t column_select = 0x0102040810204080;
+
+    // repeats byte n of a register 8 times
+    constexpr int64_t broadcast_index(int n) { return 0x0101010101010101 * n; }
+
+    // returns the 8 row bytes of plane i in the low half of the register
+    template <int BPP, DataMode Mode>
+    TARGET_SSE2 inline __m128i plane_rows(const u8 *tile, int i)
+    {
+        if (Mode == DataMode::Planar || (i == BPP-1 && BPP % 2 != 0))
+            return _mm_loadl_epi64((const __m128i *) (tile + plane_offset<BPP, Mode>(0, i)));
+        // interwined planes come in pairs with their row bytes alternated
+        __m128i pair  = _mm_loadu_si128((const __m128i *) (tile + i/2*16));
+        __m128i bytes = i % 2 == 0 ? _mm_and_si128(pair, _mm_set1_epi16(0xFF))
+                                   : _mm_srli_epi16(pair, 8);
+        return _mm_packus_epi16(bytes, bytes);
+    }
+
+    // the row bytes of plane i of two consecutive tiles
+    template <int BPP, DataMode Mode>
+    TARGET_SSE2 inline __m128i plane_rows2(const u8 *tiles, int i)
+    {
+        return _mm_unpacklo_epi64(plane_rows<BPP, Mode>(tiles, i), plane_rows<BPP, Mode>(tiles + BPP*8, i));
+    }
+
+    TARGET_SSE2 inline __m128i test_bits(__m128i v, __m128i select, __m128i bit)
+    {
+        return _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, select), select), bit);
+    }
+
+    // SSE2 has no byte shuffle, so the broadcast is done with unpacks,
+    // leaving two rows of a single tile in each register
+    template <int BPP, DataMode Mode>
+    TARGET_SSE2 inline void decode_tile_sse2(const u8 *tile, u8 *out, std::size_t stride)
+    {
+        const __m128i select = _mm_set1_epi64x(column_select);
+        __m128i acc[4] = { _mm_setzero_si128(), _mm_setzero_si128(),
+                           _mm_setzero_si128(), _mm_setzero_si128() };
+        for (int i = 0; i < BPP; i++) {
+            __m128i rows = plane_rows<BPP, Mode>(tile, i);
+            __m128i bit  = _mm_set1_epi8(char(1 << i));
+            __m128i b  = _mm_unpacklo_epi8(rows, rows);
+            __m128i lo = _mm_unpacklo_epi16(b, b);
+            __m128i hi = _mm_unpackhi_epi16(b, b);
+            acc[0] = _mm_or_si128(acc[0], test_bits(_mm_unpacklo_epi32(lo, lo), select, bit));
+            acc[1] = _mm_or_si128(acc[1], test_bits(_mm_unpackhi_epi32(lo, lo), select, bit));
+            acc[2] = _mm_or_si128(acc[2], test_bits(_mm_unpacklo_epi32(hi, hi), select, bit));
+            acc[3] = _mm_or_si128(acc[3], test_bits(_mm_unpackhi_epi32(hi, hi), select, bit));
+        }
+        for (int k = 0; k < 4; k++) {
+            _mm_storel_epi64((__m128i *) (out + (k*2  )*stride), acc[k]);
+            _mm_storeh_pd((double *)     (out + (k*2+1)*stride), _mm_castsi128_pd(acc[k]));
+        }
+    }
+
+    // with pshufb the broadcast can pick a row from any tile, so from here
+    // on a register holds one row of several tiles, which is also how they
+    // are laid out in the output: 2 tiles for SSSE3, 4 for AVX2, 8 for AVX-512
+    template <int BPP, DataMode Mode>
+    TARGET_SSSE3 inline void decode_2tiles_ssse3(const u8 *tiles, u8 *out, std::size_t stride)
+    {
+        const __m128i select = _mm_set1_epi64x(column_select);
+        __m128i acc[8];
+        for (int r = 0; r < 8; r++)
+            acc[r] = _mm_setzero_si128();
+        for (int i = 0; i < BPP; i++) {
+            __m128i rows = plane_rows2<BPP, Mode>(tiles, i);
+            __m128i bit  = _mm_set1_epi8(char(1 << i));
+            for (int r = 0; r < 8; r++) {
+                __m128i index = _mm_set_epi64x(broadcast_index(r+8), broadcast_index(r));
+                acc[r] = _mm_or_si128(acc[r], test_bits(_mm_shuffle_epi8(rows, index), select, bit));
+            }
+        }
+        for (int r = 0; r < 8; r++)
+            _mm_storeu_si128((__m128i *) (out + r*stride), acc[r]);
+    }
+
+    template <int BPP, DataMode Mode>
+    TARGET_AVX2 inline void decode_4tiles_avx2(const u8 *tiles, u8 *out, std::size_t stride)
+    {
+        const __m256i select = _mm256_set1_epi64x(column_select);
+        __m256i acc[8];
+        for (int r = 0; r < 8; r++)
+            acc[r] = _mm256_setzero_si256();
+        for (int i = 0; i < BPP; i++) {
+            __m128i rows01 = plane_rows2<BPP, Mode>(tiles,           i);
+            __m128i rows23 = plane_rows2<BPP, Mode>(tiles + 2*BPP*8, i);
+            __m256i rows = _mm256_inserti128_si256(_mm256_castsi128_si256(rows01), rows23, 1);
+            __m256i bit  = _mm256_set1_epi8(char(1 << i));
+            for (int r = 0; r < 8; r++) {
+                __m256i index = _mm256_setr_epi64x(broadcast_index(r), broadcast_index(r+8),
+                                                   broadcast_index(r), broadcast_index(r+8));
+                __m256i v = _mm256_shuffle_epi8(rows, index);
+                v = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(v, select), select), bit);
+                acc[r] = _mm256_or_si256(acc[r], v);
+            }
+        }
+        for (int r = 0; r < 8; r++)
+            _mm256_storeu_si256((__m256i *) (out + r*stride), acc[r]);
+    }
+
+    template <int BPP, DataMode Mode>
+    TARGET_AVX512 inline void decode_8tiles_avx512(const u8 *tiles, u8 *out, std::size_t stride)
+    {
+        const __m512i select = _mm512_set1_epi64(column_select);
+        __m512i acc[8];
+        for (int r = 0; r < 8; r++)
+            acc[r] = _mm512_setzero_si512();
+        for (int i = 0; i < BPP; i++) {
+            __m128i rows01 = plane_rows2<BPP, Mode>(tiles,           i);
+            __m128i rows23 = plane_rows2<BPP, Mode>(tiles + 2*BPP*8, i);
+            __m128i rows45 = plane_rows2<BPP, Mode>(tiles + 4*BPP*8, i);
+            __m128i rows67 = plane_rows2<BPP, Mode>(tiles + 6*BPP*8, i);
+            __m512i rows = _mm512_castsi128_si512(rows01);
+            rows = _mm512_inserti32x4(rows, rows23, 1);
+            rows = _mm512_inserti32x4(rows, rows45, 2);
+            rows = _mm512_inserti32x4(rows, rows67, 3);
+            __m512i bit  = _mm512_set1_epi8(char(1 << i));
+            for (int r = 0; r < 8; r++) {
+                __m512i index = _mm512_set4_epi64(broadcast_index(r+8), broadcast_index(r),
+                                                  broadcast_index(r+8), broadcast_index(r));
+                __mmask64 set = _mm512_test_epi8_mask(_mm512_shuffle_epi8(rows, index), select);
+                acc[r] = _mm512_or_si512(acc[r], _mm512_maskz_mov_epi8(set, bit));
+            }
+        }
+        for (int r = 0; r < 8; r++)
+            _mm512_storeu_si512(out + r*stride, acc[r]);
+    }
+
+    // Encoding goes the other way: shifting every pixel left by 7-i moves
+    // the bit of plane i into the sign bit of its byte, which pmovmskb then
+    // collects, giving the plane bytes of all rows in the register at once.
+    // pmovmskb puts the first byte in the lowest bit while the first pixel
+    // belongs in the highest, so the pixels of each row are reversed first.
+
+    // stores the bytes of every plane for n rows starting from row r, with
+    // bits[i] holding the bytes of plane i from lowest to highest
+    template <int BPP, DataMode Mode>
+    TARGET_SSE2 inline void store_planes(u8 *out, int r, const uint64_t *bits, int n)
+    {
+        // x86 is little endian, so the bytes are already in order
+        if constexpr(Mode == DataMode::Planar) {
+            for (int i = 0; i < BPP; i++)
+                std::memcpy(out + plane_offset<BPP, Mode>(r, i), &bits[i], n);
+        } else {
+            for (int i = 0; i+1 < BPP; i += 2) {
+                alignas(16) u8 pair[16];
+                _mm_store_si128((__m128i *) pair, _mm_unpacklo_epi8(_mm_set_epi64x(0, bits[i]),
+                                                                    _mm_set_epi64x(0, bits[i+1])));
+                std::memcpy(out + plane_offset<BPP, Mode>(r, i), pair, n*2);
+            }
+            if (BPP % 2 != 0)
+                std::memcpy(out + plane_offset<BPP, Mode>(r, BPP-1), &bits[BPP-1], n);
+        }
+    }
+
+    // loads two rows of 8 pixels into a register
+    TARGET_SSE2 inline __m128i load_rows2(const u8 *pixels, std::size_t stride)
+    {
+        __m128i v = _mm_loadl_epi64((const __m128i *) pixels);
+        return _mm_castpd_si128(_mm_loadh_pd(_mm_castsi128_pd(v), (const double *) (pixels + stride)));
+    }
+
+    TARGET_SSE2 inline __m128i reverse_rows_sse2(__m128i v)
+    {
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+
+    // index reversing every 8 bytes, for pshufb
+    const int64_t reverse_lo = 0x0001020304050607;
+    const int64_t reverse_hi = 0x08090A0B0C0D0E0F;
+
+    TARGET_SSSE3 inline __m128i reverse_rows_ssse3(__m128i v)
+    {
+        return _mm_shuffle_epi8(v, _mm_set_epi64x(reverse_hi, reverse_lo));
+    }
+
+    // v holds rows r and r+1, already reversed
+    template <int BPP, DataMode Mode>
+    TARGET_SSE2 inline void encode_rows2(__m128i v, int r, u8 *out)
+    {
+        uint64_t bits[BPP];
+        for (int i = 0; i < BPP; i++)
+            bits[i] = _mm_movemask_epi8(_mm_sll_epi16(v, _mm_cvtsi32_si128(7 - i)));
+        store_planes<BPP, Mode>(out, r, bits, 2);
+    }
+
+    template <int BPP, DataMode Mode>
+    TARGET_SSE2 inline void encode_tile_sse2(const u8 *pixels, std::size_t stride, u8 *out)
+    {
+        for (int r = 0; r < 8; r += 2)
+            encode_rows2<BPP, Mode>(reverse_rows_sse2(load_rows2(pixels + r*stride, stride)), r, out);
+    }
+
+    template <int BPP, DataMode Mode>
+    TARGET_SSSE3 inline void encode_tile_ssse3(const u8 *pixels, std::size_t stride, u8 *out)
+    {
+        for (int r = 0; r < 8; r += 2)
+            encode_rows2<BPP, Mode>(reverse_rows_ssse3(load_rows2(pixels + r*stride, stride)), r, out);
+    }
+
+    template <int BPP, DataMode Mode>
+    TARGET_AVX2 inline void encode_tile_avx2(const u8 *pixels, std::size_t stride, u8 *out)
+    {
+        const __m256i reverse = _mm256_setr_epi64x(reverse_lo, reverse_hi, reverse_lo, reverse_hi);
+        for (int r = 0; r < 8; r += 4) {
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(load_rows2(pixels + r*stride, stride)),
+                                                load_rows2(pixels + (r+2)*stride, stride), 1);
+            v = _mm256_shuffle_epi8(v, reverse);
+            uint64_t bits[BPP];
+            for (int i = 0; i < BPP; i++)
+                bits[i] = uint32_t(_mm256_movemask_epi8(_mm256_sll_epi16(v, _mm_cvtsi32_si128(7 - i))));
+            store_planes<BPP, Mode>(out, r, bits, 4);
+        }
+    }
+
+    // a whole tile fits in a register, and the test instruction can pick
+    // any bit directly instead of shifting it to the sign
+    template <int BPP, DataMode Mode>
+    TARGET_AVX512 inline void encode_tile_avx512(const u8 *pixels, std::size_t stride, u8 *out)
+    {
+        const __m512i reverse = _mm512_set4_epi64(reverse_hi, reverse_lo, reverse_hi, reverse_lo);
+        __m512i v = _mm512_castsi128_si512(load_rows2(pixels, stride));
+        v = _mm512_inserti32x4(v, load_rows2(pixels + 2*stride, stride), 1);
+        v = _mm512_inserti32x4(v, load_rows2(pixels + 4*stride, stride), 2);
+        v = _mm512_inserti32x4(v, load_rows2(pixels + 6*stride, stride), 3);
+        v = _mm512_shuffle_epi8(v, reverse);
+        uint64_t bits[BPP];
+        for (int i = 0; i < BPP; i++)
+            bits[i] = _mm512_test_epi8_mask(v, _mm512_set1_epi8(char(1 << i)));
+        store_planes<BPP, Mode>(out, 0, bits, 8);
+    }
+
+    // Palettizing: with up to 16 colors pshufb can do the lookup of each
+    // channel separately, vpermd (AVX2) and vpermd/vpermt2d (AVX-512) can
+    // look up entire colors for up to 16 and 32 colors. Anything bigger
+    // needs a gather.
+
+    TARGET_SSSE3 void palettize_ssse3(const uint8_t *pixels, std::size_t n, const uint32_t *lut, int colors, uint32_t *out)
+    {
+        if (colors > 16)
+            return palettize_scalar(pixels, n, lut, colors, out);
+        // one register with 16 entries for each channel
+        alignas(16) u8 channels[4][16];
+        for (int i = 0; i < 16; i++)
+            for (int c = 0; c < 4; c++)
+                channels[c][i] = lut[i] >> c*8;
+        __m128i c0 = _mm_load_si128((const __m128i *) channels[0]);
+        __m128i c1 = _mm_load_si128((const __m128i *) channels[1]);
+        __m128i c2 = _mm_load_si128((const __m128i *) channels[2]);
+        __m128i c3 = _mm_load_si128((const __m128i *) channels[3]);
+        std::size_t i = 0;
+        for ( ; i + 16 <= n; i += 16) {
+            __m128i index = _mm_loadu_si128((const __m128i *) (pixels + i));
+            __m128i v0 = _mm_shuffle_epi8(c0, index);
+            __m128i v1 = _mm_shuffle_epi8(c1, index);
+            __m128i v2 = _mm_shuffle_epi8(c2, index);
+            __m128i v3 = _mm_shuffle_epi8(c3, index);
+            __m128i lo01 = _mm_unpacklo_epi8(v0, v1), hi01 = _mm_unpackhi_epi8(v0, v1);
+            __m128i lo23 = _mm_unpacklo_epi8(v2, v3), hi23 = _mm_unpackhi_epi8(v2, v3);
+            _mm_storeu_si128((__m128i *) (out + i     ), _mm_unpacklo_epi16(lo01, lo23));
+            _mm_storeu_si128((__m128i *) (out + i +  4), _mm_unpackhi_epi16(lo01, lo23));
+            _mm_storeu_si128((__m128i *) (out + i +  8), _mm_unpacklo_epi16(hi01, hi23));
+            _mm_storeu_si128((__m128i *) (out + i + 12), _mm_unpackhi_epi16(hi01, hi23));
+        }
+        palettize_scalar(pixels + i, n - i, lut, colors, out + i);
+    }
+
+    TARGET_AVX2 void palettize_avx2(const uint8_t *pixels, std::size_t n, const uint32_t *lut, int colors, uint32_t *out)
+    {
+        __m256i lo = _mm256_loadu_si256((const __m256i *) lut);
+        __m256i hi = _mm256_loadu_si256((const __m256i *) (lut + 8));
+        std::size_t i = 0;
+        for ( ; i + 8 <= n; i += 8) {
+            __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (pixels + i)));
+            __m256i v;
+            if (colors <= 8)
+                v = _mm256_permutevar8x32_epi32(lo, index);
+            else if (colors <= 16)
+                v = _mm256_blendv_epi8(_mm256_permutevar8x32_epi32(lo, index),
+                                       _mm256_permutevar8x32_epi32(hi, index),
+                                       _mm256_cmpgt_epi32(index, _mm256_set1_epi32(7)));
+            else
+                v = _mm256_i32gather_epi32((const int *) lut, index, 4);
+            _mm256_storeu_si256((__m256i *) (out + i), v);
+        }
+        palettize_scalar(pixels + i, n - i, lut, colors, out + i);
+    }
+
+    TARGET_AVX512 void palettize_avx512(const uint8_t *pixels, std::size_t n, const uint32_t *lut, int colors, uint32_t *out)
+    {
+        __m512i lo = _mm512_loadu_si512(lut);
+        __m512i hi = _mm512_loadu_si512(lut + 16);
+        std::size_t i = 0;
+        for ( ; i + 16 <= n; i += 16) {
+            __m512i index = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) (pixels + i)));
+            __m512i v = colors <= 16 ? _mm512_permutexvar_epi32(index, lo)
+                      : colors <= 32 ? _mm512_permutex2var_epi32(lo, index, hi)
+                      :                _mm512_i32gather_epi32(index, lut, 4);
+            _mm512_storeu_si512(out + i, v);
+        }
+        palettize_scalar(pixels + i, n - i, lut, colors, out + i);
+    }
+
+    // Nearest color: pmaddwd squares and adds two 16-bit differences at once,
+    // so each word of the palette needs a subtraction and a pmaddwd. Every
+    // lane keeps its own best entry; the lanes are merged at the end.
+
+    inline int merge_lanes(const int32_t *dist, const int32_t *index, int lanes)
+    {
+        int best = 0;
+        for (int i = 1; i < lanes; i++)
+            if (dist[i] < dist[best] || (dist[i] == dist[best] && index[i] < index[best]))
+                best = i;
+        return index[best];
+    }
+
+    TARGET_SSE2 int nearest_sse2(const uint32_t *pal0, const uint32_t *pal1, std::size_t n, uint32_t color0, uint32_t color1)
+    {
+        __m128i c0 = _mm_set1_epi32(color0);
+        __m128i c1 = _mm_set1_epi32(color1);
+        __m128i best_dist = _mm_set1_epi32(INT32_MAX);
+        __m128i best = _mm_setzero_si128();
+        __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+        for (std::size_t i = 0; i < n; i += 4) {
+            __m128i d0 = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) (pal0 + i)), c0);
+            __m128i d1 = _mm_sub_epi16(_mm_loadu_si128((const __m128i *) (pal1 + i)), c1);
+            __m128i dist = _mm_add_epi32(_mm_madd_epi16(d0, d0), _mm_madd_epi16(d1, d1));
+            __m128i less = _mm_cmplt_epi32(dist, best_dist);
+            best_dist = _mm_or_si128(_mm_and_si128(less, dist), _mm_andnot_si128(less, best_dist));
+            best      = _mm_or_si128(_mm_and_si128(less, index), _mm_andnot_si128(less, best));
+            index = _mm_add_epi32(index, _mm_set1_epi32(4));
+        }
+        alignas(16) int32_t dists[4], indexes[4];
+        _mm_store_si128((__m128i *) dists, best_dist);
+        _mm_store_si128((__m128i *) indexes, best);
+        return merge_lanes(dists, indexes, 4);
+    }
+
+    TARGET_AVX2 int nearest_avx2(const uint32_t *pal0, const uint32_t *pal1, std::size_t n, uint32_t color0, uint32_t color1)
+    {
+        __m256i c0 = _mm256_set1_epi32(color0);
+        __m256i c1 = _mm256_set1_epi32(color1);
+        __m256i best_dist = _mm256_set1_epi32(INT32_MAX);
+        __m256i best = _mm256_setzero_si256();
+        __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        for (std::size_t i = 0; i < n; i += 8) {
+            __m256i d0 = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *) (pal0 + i)), c0);
+            __m256i d1 = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i *) (pal1 + i)), c1);
+            __m256i dist = _mm256_add_epi32(_mm256_madd_epi16(d0, d0), _mm256_madd_epi16(d1, d1));
+            __m256i less = _mm256_cmpgt_epi32(best_dist, dist);
+            best_dist = _mm256_blendv_epi8(best_dist, dist, less);
+            best      = _mm256_blendv_epi8(best, index, less);
+            index = _mm256_add_epi32(index, _mm256_set1_epi32(8));
+        }
+        alignas(32) int32_t dists[8], indexes[8];
+        _mm256_store_si256((__m256i *) dists, best_dist);
+        _mm256_store_si256((__m256i *) indexes, best);
+        return merge_lanes(dists, indexes, 8);
+    }
+
+    TARGET_AVX512 int nearest_avx512(const uint32_t *pal0, const uint32_t *pal1, std::size_t n, uint32_t color0, uint32_t color1)
+    {
+        __m512i c0 = _mm512_set1_epi32(color0);
+        __m512i c1 = _mm512_set1_epi32(color1);
+        __m512i best_dist = _mm512_set1_epi32(INT32_MAX);
+        __m512i best = _mm512_setzero_si512();
+        __m512i index = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        for (std::size_t i = 0; i < n; i += 16) {
+            __m512i d0 = _mm512_sub_epi16(_mm512_loadu_si512(pal0 + i), c0);
+            __m512i d1 = _mm512_sub_epi16(_mm512_loadu_si512(pal1 + i), c1);
+            __m512i dist = _mm512_add_epi32(_mm512_madd_epi16(d0, d0), _mm512_madd_epi16(d1, d1));
+            __mmask16 less = _mm512_cmplt_epi32_mask(dist, best_dist);
+            best_dist = _mm512_mask_mov_epi32(best_dist, less, dist);
+            best      = _mm512_mask_mov_epi32(best, less, index);
+            index = _mm512_add_epi32(index, _mm512_set1_epi32(16));
+        }
+        alignas(64) int32_t dists[16], indexes[16];
+        _mm512_store_si512(dists, best_dist);
+        _mm512_store_si512(indexes, best);
+        return merge_lanes(dists, indexes, 16);
+    }
+
+    // the SSE2 and SSSE3 decoders do a round of bit tests for every plane,
+    // while the scalar one spreads a whole row byte with one table lookup.
+    // past a few planes that makes them slower, so from there on their
+    // tables have no decoder and codec_table() puts the scalar one instead.
+    // SSE2 also has no pshufb, so separating interwined planes costs more
+    template <int BPP, int MinScalarBpp, typename TileCodec>
+    constexpr DecodeFn decoder_below()
+    {
+        if constexpr(BPP >= MinScalarBpp)
+            return nullptr;
+        else
+            return TileCodec::decode_tiles;
+    }
+
+    template <int BPP, DataMode Mode>
+    struct TileCodecSSE2 {
+        TARGET_SSE2 static void decode_tiles(const uint8_t *tiles, std::size_t num_tiles, uint8_t *out, std::size_t stride)
+        {
+            for (std::size_t t = 0; t < num_tiles; t++)
+                decode_tile_sse2<BPP, Mode>(tiles + t*BPP*8, out + t*8, stride);
+        }
+
+        static constexpr DecodeFn decode = decoder_below<BPP, Mode == DataMode::Planar ? 3 : 2, TileCodecSSE2>();
+
+        TARGET_SSE2 static void encode(const uint8_t *pixels, std::size_t num_tiles, std::size_t stride, uint8_t *out)
+        {
+            for (std::size_t t = 0; t < num_tiles; t++)
+                encode_tile_sse2<BPP, Mode>(pixels + t*8, stride, out + t*BPP*8);
+        }
+    };
+
+    template <int BPP, DataMode Mode>
+    struct TileCodecSSSE3 {
+        TARGET_SSSE3 static void decode_tiles(const uint8_t *tiles, std::size_t num_tiles, uint8_t *out, std::size_t stride)
+        {
+            std::size_t t = 0;
+            for ( ; t + 2 <= num_tiles; t += 2)
+                decode_2tiles_ssse3<BPP, Mode>(tiles + t*BPP*8, out + t*8, stride);
+            if (t < num_tiles)
+                decode_tile_sse2<BPP, Mode>(tiles + t*BPP*8, out + t*8, stride);
+        }
+
+        static constexpr DecodeFn decode = decoder_below<BPP, 3, TileCodecSSSE3>();
+
+        TARGET_SSSE3 static void encode(const uint8_t *pixels, std::size_t num_tiles, std::size_t stride, uint8_t *out)
+        {
+            for (std::size_t t = 0; t < num_tiles; t++)
+                encode_tile_ssse3<BPP, Mode>(pixels + t*8, stride, out + t*BPP*8);
+        }
+    };
+
+    template <int BPP, DataMode Mode>
+    struct TileCodecAVX2 {
+        TARGET_AVX2 static void decode(const uint8_t *tiles, std::size_t num_tiles, uint8_t *out, std::size_t stride)
+        {
+            std::size_t t = 0;
+            for ( ; t + 4 <= num_tiles; t += 4)
+                decode_4tiles_avx2<BPP, Mode>(tiles + t*BPP*8, out + t*8, stride);
+            for ( ; t < num_tiles; t++)
+                decode_tile_sse2<BPP, Mode>(tiles + t*BPP*8, out + t*8, stride);
+        }
+
+        TARGET_AVX2 static void encode(const uint8_t *pixels, std::size_t num_tiles, std::size_t stride, uint8_t *out)
+        {
+            for (std::size_t t = 0; t < num_tiles; t++)
+                encode_tile_avx2<BPP, Mode>(pixels + t*8, stride, out + t*BPP*8);
+        }
+    };
+
+    template <int BPP, DataMode Mode>
+    struct TileCodecAVX512 {
+        TARGET_AVX512 static void decode(const uint8_t *tiles, std::size_t num_tiles, uint8_t *out, std::size_t stride)
+        {
+            std::size_t t = 0;
+            for ( ; t + 8 <= num_tiles; t += 8)
+                decode_8tiles_avx512<BPP, Mode>(tiles + t*BPP*8, out + t*8, stride);
+            for ( ; t + 4 <= num_tiles; t += 4)
+                decode_4tiles_avx2<BPP, Mode>(tiles + t*BPP*8, out + t*8, stride);
+            for ( ; t < num_tiles; t++)
+                decode_tile_sse2<BPP, Mode>(tiles + t*BPP*8, out + t*8, stride);
+        }
+
+        TARGET_AVX512 static void encode(const uint8_t *pixels, std::size_t num_tiles, std::size_t stride, uint8_t *out)
+        {
+            for (std::size_t t = 0; t < num_tiles; t++)
+                encode_tile_avx512<BPP, Mode>(pixels + t*8, stride, out + t*BPP*8);
+        }
+    };
+}
+
+constexpr CodecTable sse2_codecs   = make_codec_table<TileCodecSSE2>();
+constexpr CodecTable ssse3_codecs  = make_codec_table<TileCodecSSSE3>();
+constexpr CodecTable avx2_codecs   = make_codec_table<TileCodecAVX2>();
+constexpr CodecTable avx512_codecs = make_codec_table<TileCodecAVX512>();
+
+SimdLevel detect_simd_level()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+        return SimdLevel::SSSE3;
+    if (__builtin_cpu_supports("sse2"))
+        return SimdLevel::SSE2;
+    return SimdLevel::Scalar;
+}
+
+namespace {
+    // fills the decoders missing from a table with the scalar ones.
+    // scalar_codecs is constant, so this can run at any time; it's done on
+    // first use to not depend on the order of static initialization
+    CodecTable with_scalar_decode(CodecTable table)
+    {
+        for (std::size_t i = 0; i < table.size(); i++)
+            if (!table[i].decode)
+                table[i].decode = scalar_codecs[i].decode;
+        return table;
+    }
+}
+
+const CodecTable &codec_table(SimdLevel level)
+{
+    switch (level) {
+    case SimdLevel::AVX512: return avx512_codecs;
+    case SimdLevel::AVX2:   return avx2_codecs;
+    case SimdLevel::SSSE3: {
+        static const CodecTable table = with_scalar_decode(ssse3_codecs);
+        return table;
+    }
+    case SimdLevel::SSE2: {
+        static const CodecTable table = with_scalar_decode(sse2_codecs);
+        return table;
+    }
+    default:                return scalar_codecs;
+    }
+}
+
+PalettizeFn palettize_kernel(SimdLevel level)
+{
+    switch (level) {
+    case SimdLevel::AVX512: return palettize_avx512;
+    case SimdLevel::AVX2:   return palettize_avx2;
+    case SimdLevel::SSSE3:  return palettize_ssse3;
+    default:                return palettize_scalar;
+    }
+}
+
+NearestFn nearest_kernel(SimdLevel level)
+{
+    switch (level) {
+    case SimdLevel::AVX512: return nearest_avx512;
+    case SimdLevel::AVX2:   return nearest_avx2;
+    case SimdLevel::SSSE3:
+    case SimdLevel::SSE2:   return nearest_sse2;
+    default:                return nearest_scalar;
+    }
+}
+
+} // namespace chr::kernels
+
+#endif
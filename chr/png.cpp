@@ -0,0 +1,391 @@
+#include "png.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+
+using u8 = uint8_t;
+using u32 = uint32_t;
+
+namespace png {
+
+namespace {
+    constexpr std::array<u8, 8> signature = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    // compressed data is written in IDAT chunks of this size
+    constexpr std::size_t IDAT_SIZE = 64 * 1024;
+    // images read_indexed() takes: no side over 2^24, as in stb_image,
+    // and no more than 256M pixels
+    constexpr std::size_t MAX_DIMENSION = 1 << 24;
+    constexpr std::size_t MAX_PIXELS = 1 << 28;
+
+    const std::array<std::string_view, 6> filter_names = { "none", "sub", "up", "average", "paeth", "adaptive" };
+
+    void put32(u8 *p, u32 value)
+    {
+        p[0] = value >> 24;
+        p[1] = value >> 16;
+        p[2] = value >>  8;
+        p[3] = value;
+    }
+
+    int bit_depth(int bpp)
+    {
+        return bpp <= 1 ? 1 : bpp <= 2 ? 2 : bpp <= 4 ? 4 : 8;
+    }
+
+    u32 get32(const u8 *p)
+    {
+        return u32(p[0]) << 24 | u32(p[1]) << 16 | u32(p[2]) << 8 | p[3];
+    }
+
+    u8 paeth(u8 a, u8 b, u8 c)
+    {
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+}
+
+std::optional<Filter> filter_from_name(std::string_view name)
+{
+    for (std::size_t i = 0; i < filter_names.size(); i++)
+        if (name == filter_names[i])
+            return static_cast<Filter>(i);
+    return std::nullopt;
+}
+
+IndexedWriter::~IndexedWriter()
+{
+    if (zs_init)
+        deflateEnd(&zs);
+}
+
+// writes to fp, or keeps the bytes for later while the header can't be written
+void IndexedWriter::emit(std::span<const uint8_t> data)
+{
+    if (holding) {
+        held.insert(held.end(), data.begin(), data.end());
+        return;
+    }
+    if (!data.empty() && std::fwrite(data.data(), 1, data.size(), fp) != data.size())
+        failed = true;
+    chr::stats::add(chr::stats::Counter::BytesWritten, data.size());
+}
+
+void IndexedWriter::write_chunk(const char *type, std::span<const uint8_t> data)
+{
+    std::array<u8, 8> header;
+    put32(&header[0], data.size());
+    std::memcpy(&header[4], type, 4);
+    // crc32() with no data returns 0 instead of the crc passed in
+    u32 crc = crc32(0, &header[4], 4);
+    if (!data.empty())
+        crc = crc32(crc, data.data(), data.size());
+    std::array<u8, 4> footer;
+    put32(&footer[0], crc);
+    emit(header);
+    emit(data);
+    emit(footer);
+}
+
+std::array<uint8_t, 13> IndexedWriter::ihdr() const
+{
+    std::array<u8, 13> data = {};
+    put32(&data[0], width);
+    put32(&data[4], height);
+    data[8] = depth;
+    data[9] = 3; // indexed color
+    return data;
+}
+
+// everything up to the image data
+void IndexedWriter::write_header()
+{
+    emit(signature);
+    write_chunk("IHDR", ihdr());
+    if (!plte.empty())
+        write_chunk("PLTE", plte);
+    if (!trns.empty())
+        write_chunk("tRNS", trns);
+}
+
+// feeds data to zlib, writing an IDAT chunk every time the buffer fills up
+void IndexedWriter::compress(std::span<const uint8_t> data, int flush)
+{
+    zs.next_in = const_cast<u8 *>(data.data());
+    zs.avail_in = data.size();
+    for (;;) {
+        int res = deflate(&zs, flush);
+        if (zs.avail_out == 0) {
+            write_chunk("IDAT", out);
+            zs.next_out = out.data();
+            zs.avail_out = out.size();
+            continue;
+        }
+        if (res == Z_STREAM_END || (flush == Z_NO_FLUSH && zs.avail_in == 0))
+            break;
+        if (res != Z_OK && res != Z_BUF_ERROR) {
+            std::fprintf(stderr, "error: zlib failed to compress image\n");
+            failed = true;
+            break;
+        }
+    }
+    if (flush == Z_FINISH && zs.avail_out != out.size())
+        write_chunk("IDAT", std::span{out}.first(out.size() - zs.avail_out));
+}
+
+// filters row into dest, using the previous row where needed. pixels are at
+// most a byte, so the byte to the left is always the previous one
+void IndexedWriter::filter_row(Filter f, uint8_t *dest)
+{
+    std::size_t n = row.size();
+    switch (f) {
+    case Filter::Sub:
+        for (std::size_t i = 0; i < n; i++)
+            dest[i] = row[i] - (i > 0 ? row[i-1] : 0);
+        break;
+    case Filter::Up:
+        for (std::size_t i = 0; i < n; i++)
+            dest[i] = row[i] - prev[i];
+        break;
+    case Filter::Average:
+        for (std::size_t i = 0; i < n; i++)
+            dest[i] = row[i] - ((i > 0 ? row[i-1] : 0) + prev[i]) / 2;
+        break;
+    case Filter::Paeth:
+        for (std::size_t i = 0; i < n; i++)
+            dest[i] = row[i] - paeth(i > 0 ? row[i-1] : 0, prev[i], i > 0 ? prev[i-1] : 0);
+        break;
+    default:
+        std::copy(row.begin(), row.end(), dest);
+    }
+}
+
+bool IndexedWriter::start(FILE *f, std::size_t w, std::size_t h, int bpp, const chr::Palette &palette,
+                          const WriteOptions &opts)
+{
+    if (w == 0 || w > 0x7FFFFFFF || h > 0x7FFFFFFF || bpp < 1 || bpp > 8) {
+        std::fprintf(stderr, "error: can't write a %zux%zu PNG with %d bpp\n", w, h, bpp);
+        return false;
+    }
+    if (deflateInit(&zs, opts.level) != Z_OK) {
+        std::fprintf(stderr, "error: invalid compression level %d\n", opts.level);
+        return false;
+    }
+    zs_init = true;
+    fp = f;
+    width = w;
+    height = h;
+    depth = bit_depth(bpp);
+    filter = opts.filter;
+    row.assign((width * depth + 7) / 8, 0);
+    prev.assign(row.size(), 0);
+    line.assign(row.size() + 1, 0);
+    best.assign(row.size() + 1, 0);
+    out.assign(IDAT_SIZE, 0);
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+
+    std::size_t num_colors = std::min<std::size_t>(palette.size(), 1 << bpp);
+    plte.clear();
+    trns.clear();
+    for (std::size_t i = 0; i < num_colors; i++) {
+        plte.insert(plte.end(), { palette[i].red(), palette[i].green(), palette[i].blue() });
+        trns.push_back(palette[i].alpha());
+    }
+    // entries missing from tRNS are opaque
+    while (!trns.empty() && trns.back() == 0xFF)
+        trns.pop_back();
+
+    // without a height, the header is written with a height of 0 and
+    // fixed by finish(). if fp can't go back to it, the header waits and
+    // the compressed data is held in memory until then
+    unknown_height = height == 0;
+    if (unknown_height) {
+        header_pos = std::ftell(fp);
+        holding = header_pos < 0 || std::fseek(fp, header_pos, SEEK_SET) != 0;
+        if (holding)
+            return true;
+    }
+    write_header();
+    return !failed;
+}
+
+bool IndexedWriter::write_row(std::span<const uint8_t> pixels)
+{
+    if (!unknown_height && rows_written == height)
+        return false;
+    std::fill(row.begin(), row.end(), 0);
+    int per_byte = 8 / depth;
+    u8 mask = (1 << depth) - 1;
+    for (std::size_t x = 0; x < std::min(width, pixels.size()); x++)
+        row[x / per_byte] |= (pixels[x] & mask) << (8 - depth - x % per_byte * depth);
+
+    if (filter != Filter::Adaptive) {
+        line[0] = static_cast<u8>(filter);
+        filter_row(filter, &line[1]);
+    } else {
+        // keep the filter with the smallest sum of values taken as signed,
+        // a good guess of which one compresses best
+        unsigned long best_sum = -1;
+        for (auto f : { Filter::None, Filter::Sub, Filter::Up, Filter::Average, Filter::Paeth }) {
+            filter_row(f, &line[1]);
+            unsigned long sum = 0;
+            for (std::size_t i = 1; i < line.size(); i++)
+                sum += std::abs(static_cast<int8_t>(line[i]));
+            if (sum < best_sum) {
+                best_sum = sum;
+                best[0] = static_cast<u8>(f);
+                std::copy(line.begin() + 1, line.end(), best.begin() + 1);
+            }
+        }
+        std::swap(line, best);
+    }
+    compress(line, Z_NO_FLUSH);
+    std::swap(row, prev);
+    rows_written++;
+    return !failed;
+}
+
+bool IndexedWriter::finish()
+{
+    // missing rows are left blank
+    std::vector<u8> blank(width, 0);
+    while (rows_written < height)
+        write_row(blank);
+    compress({}, Z_FINISH);
+    if (unknown_height) {
+        if (rows_written == 0 || rows_written > 0x7FFFFFFF) {
+            std::fprintf(stderr, "error: can't write a %zux%zu PNG\n", width, rows_written);
+            return false;
+        }
+        height = rows_written;
+        if (holding) {
+            holding = false;
+            write_header();
+            emit(held);
+            held = {};
+        } else {
+            // only the height and the CRC of IHDR change
+            auto data = ihdr();
+            std::array<u8, 8> fix;
+            put32(&fix[0], height);
+            put32(&fix[4], crc32(crc32(0, (const u8 *) "IHDR", 4), data.data(), data.size()));
+            long end = std::ftell(fp);
+            long height_pos = header_pos + signature.size() + 8 + 4;
+            long crc_pos = header_pos + signature.size() + 8 + data.size();
+            if (std::fseek(fp, height_pos, SEEK_SET) != 0 || std::fwrite(&fix[0], 1, 4, fp) != 4
+             || std::fseek(fp, crc_pos, SEEK_SET) != 0 || std::fwrite(&fix[4], 1, 4, fp) != 4
+             || std::fseek(fp, end, SEEK_SET) != 0)
+                failed = true;
+        }
+    }
+    write_chunk("IEND", {});
+    std::fflush(fp);
+    return !failed && !std::ferror(fp);
+}
+
+std::optional<IndexedImage> read_indexed(std::span<const uint8_t> data)
+{
+    if (data.size() < signature.size() || !std::equal(signature.begin(), signature.end(), data.begin()))
+        return std::nullopt;
+
+    IndexedImage img = {};
+    int depth = 0;
+    std::vector<u8> raw;
+    std::size_t row_bytes = 0, raw_size = 0;
+    bool ended = false;
+    z_stream zs = {};
+    if (inflateInit(&zs) != Z_OK)
+        return std::nullopt;
+
+    for (std::size_t pos = signature.size(); pos + 12 <= data.size() && !ended; ) {
+        u32 length = get32(&data[pos]);
+        std::string_view type{(const char *) &data[pos + 4], 4};
+        if (data.size() - pos - 12 < length)
+            break;
+        const u8 *body = &data[pos + 8];
+        pos += 12 + length;
+
+        if (type == "IHDR") {
+            if (length != 13)
+                break;
+            img.width  = get32(body);
+            img.height = get32(body + 4);
+            depth = body[8];
+            // only indexed, non interlaced images
+            if (body[9] != 3 || body[12] != 0 || img.width == 0 || img.height == 0
+             || (depth != 1 && depth != 2 && depth != 4 && depth != 8))
+                break;
+            // like stb_image's STBI_MAX_DIMENSIONS, so that a bad header
+            // can't ask for more memory than any sensible image needs
+            if (img.width > MAX_DIMENSION || img.height > MAX_DIMENSION || img.width * img.height > MAX_PIXELS)
+                break;
+            row_bytes = (img.width * depth + 7) / 8;
+            raw_size = (row_bytes + 1) * img.height;
+        } else if (type == "PLTE") {
+            for (u32 i = 0; i + 3 <= length && i/3 < 256; i += 3)
+                img.palette.push_back(chr::ColorRGBA{body[i], body[i+1], body[i+2], 0xFF});
+        } else if (type == "tRNS") {
+            for (u32 i = 0; i < std::min<std::size_t>(length, img.palette.size()); i++)
+                img.palette[i] = chr::ColorRGBA{img.palette[i].red(), img.palette[i].green(), img.palette[i].blue(), body[i]};
+        } else if (type == "IDAT") {
+            if (raw_size == 0)
+                break;
+            // raw only grows as data is inflated into it, so its size is
+            // bounded by what the file really holds, not by the header
+            zs.next_in = const_cast<u8 *>(body);
+            zs.avail_in = length;
+            int res = Z_OK;
+            while (res == Z_OK && zs.avail_in != 0 && zs.total_out < raw_size) {
+                if (zs.total_out == raw.size())
+                    raw.resize(std::min(raw_size, std::max<std::size_t>(raw.size() * 2, 64 * 1024)));
+                zs.next_out = raw.data() + zs.total_out;
+                zs.avail_out = raw.size() - zs.total_out;
+                res = inflate(&zs, Z_NO_FLUSH);
+            }
+            if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+                break;
+        } else if (type == "IEND")
+            ended = true;
+    }
+    bool complete = ended && raw_size != 0 && zs.total_out == raw_size && !img.palette.empty();
+    inflateEnd(&zs);
+    if (!complete)
+        return std::nullopt;
+
+    // undo filters in place, then unpack the pixels
+    img.pixels = chr::HeapArray<uint8_t>{img.width * img.height};
+    std::vector<u8> zero(row_bytes, 0);
+    int per_byte = 8 / depth;
+    u8 mask = (1 << depth) - 1;
+    for (std::size_t y = 0; y < img.height; y++) {
+        u8 *row = &raw[y * (row_bytes + 1) + 1];
+        const u8 *prev = y == 0 ? zero.data() : row - (row_bytes + 1);
+        switch (row[-1]) {
+        case 0: break;
+        case 1: for (std::size_t i = 1; i < row_bytes; i++) row[i] += row[i-1]; break;
+        case 2: for (std::size_t i = 0; i < row_bytes; i++) row[i] += prev[i]; break;
+        case 3:
+            for (std::size_t i = 0; i < row_bytes; i++)
+                row[i] += ((i > 0 ? row[i-1] : 0) + prev[i]) / 2;
+            break;
+        case 4:
+            for (std::size_t i = 0; i < row_bytes; i++)
+                row[i] += paeth(i > 0 ? row[i-1] : 0, prev[i], i > 0 ? prev[i-1] : 0);
+            break;
+        default:
+            return std::nullopt;
+        }
+        u8 *out = &img.pixels[y * img.width];
+        if (depth == 8)
+            std::copy(row, row + img.width, out);
+        else
+            for (std::size_t x = 0; x < img.width; x++)
+                out[x] = row[x / per_byte] >> (8 - depth - x % per_byte * depth) & mask;
+    }
+    return img;
+}
+
+} // namespace png
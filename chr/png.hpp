@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+#include <zlib.h>
+#include "chr.hpp"
+
+// Minimal PNG support for indexed images, which is all chr data needs.
+namespace png {
+
+// the filter applied to each row before compression. Adaptive tries them all
+// and keeps the one that's likely to compress best for every row
+enum class Filter { None, Sub, Up, Average, Paeth, Adaptive };
+
+struct WriteOptions {
+    int level = Z_DEFAULT_COMPRESSION; // zlib compression level, 0-9
+    Filter filter = Filter::None;      // None is usually best for indexed images
+};
+
+// writes an indexed PNG one row at a time, compressing rows as they come.
+// the bit depth is the smallest one that can hold bpp bits: 1, 2, 4 or 8
+class IndexedWriter {
+    FILE *fp = nullptr;
+    bool failed = false;
+    std::size_t width = 0, height = 0, rows_written = 0;
+    int depth = 0;
+    Filter filter = Filter::None;
+    z_stream zs = {};
+    bool zs_init = false;
+    std::vector<uint8_t> row, prev, line, best, out, plte, trns;
+    // for images started without a height
+    bool unknown_height = false;
+    long header_pos = -1;
+    bool holding = false;       // fp can't seek, so the output is kept in held
+    std::vector<uint8_t> held;
+
+    std::array<uint8_t, 13> ihdr() const;
+    void emit(std::span<const uint8_t> data);
+    void write_chunk(const char *type, std::span<const uint8_t> data);
+    void write_header();
+    void compress(std::span<const uint8_t> data, int flush);
+    void filter_row(Filter f, uint8_t *dest);
+
+public:
+    IndexedWriter() = default;
+    ~IndexedWriter();
+    IndexedWriter(const IndexedWriter &) = delete;
+    IndexedWriter & operator=(const IndexedWriter &) = delete;
+
+    // writes everything up to the image data. the palette gets the first
+    // 1 << bpp colors, plus transparency if any of them isn't opaque.
+    // a height of 0 means it isn't known yet: the image gets as many rows
+    // as are written. the header is then fixed at the end if fp can seek,
+    // otherwise it's held back with the compressed rows until finish()
+    bool start(FILE *fp, std::size_t width, std::size_t height, int bpp, const chr::Palette &palette,
+               const WriteOptions &opts = {});
+    // row has one pixel per byte
+    bool write_row(std::span<const uint8_t> row);
+    // writes the rest of the file. returns false if anything failed
+    bool finish();
+};
+
+std::optional<Filter> filter_from_name(std::string_view name);
+
+struct IndexedImage {
+    std::size_t width, height;
+    std::vector<chr::ColorRGBA> palette; // with alpha from tRNS
+    chr::HeapArray<uint8_t> pixels;      // palette indexes, one per byte
+};
+
+// reads an indexed PNG without expanding it to colors. returns nullopt if
+// data isn't one (other color types, interlaced images, broken files...),
+// so that a more general loader can be tried
+std::optional<IndexedImage> read_indexed(std::span<const uint8_t> data);
+
+} // namespace png
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+// Counters and timers for finding out where conversions spend their time.
+// Counters are added to once per call or per file, never per tile or pixel.
+// Timers read the clock at every step; chr_to_image() alternates decoding
+// and compression, so there it's twice per strip of 16 tiles. Both are
+// cheap enough to leave on; build with CHR_NO_STATS to remove them.
+namespace chr::stats {
+
+enum class Counter {
+    Files,          // whole files converted
+    BytesRead,      // input files
+    TilesDecoded,
+    TilesEncoded,
+    PaletteMisses,  // pixels with colors not in the palette
+    BytesWritten,   // output files
+};
+constexpr int NUM_COUNTERS = 6;
+
+enum class Phase {
+    Load,
+    Decode,
+    Palettize,
+    Encode,
+    Write,
+};
+constexpr int NUM_PHASES = 5;
+
+#ifdef CHR_NO_STATS
+constexpr bool enabled = false;
+#else
+constexpr bool enabled = true;
+#endif
+
+namespace detail {
+    inline std::array<std::atomic<uint64_t>, NUM_COUNTERS> counters = {};
+    inline std::array<std::atomic<uint64_t>, NUM_PHASES> phase_ns = {};
+}
+
+inline void add(Counter c, uint64_t n)
+{
+    if constexpr(enabled)
+        detail::counters[static_cast<int>(c)].fetch_add(n, std::memory_order_relaxed);
+}
+
+// measures the time between laps. on destruction, the time of each phase is
+// added to the totals. with CHR_NO_STATS it does nothing, not even read the clock
+class Timer {
+    using clock = std::chrono::steady_clock;
+    clock::time_point last;
+    std::array<clock::duration, NUM_PHASES> times = {};
+
+public:
+    Timer()
+    {
+        if constexpr(enabled)
+            last = clock::now();
+    }
+
+    Timer(const Timer &) = delete;
+    Timer & operator=(const Timer &) = delete;
+
+    ~Timer()
+    {
+        if constexpr(enabled)
+            for (int i = 0; i < NUM_PHASES; i++)
+                detail::phase_ns[i].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(times[i]).count(),
+                                              std::memory_order_relaxed);
+    }
+
+    // adds the time since the last lap (or since construction) to phase
+    void lap(Phase phase)
+    {
+        if constexpr(enabled) {
+            auto now = clock::now();
+            times[static_cast<int>(phase)] += now - last;
+            last = now;
+        }
+    }
+};
+
+// seconds from some fixed point, whether or not stats are enabled, for
+// timing single calls. out of line, so that code that only uses Timer
+// doesn't read the clock with CHR_NO_STATS
+double clock_seconds();
+
+struct Snapshot {
+    std::array<uint64_t, NUM_COUNTERS> counters;
+    std::array<double, NUM_PHASES> seconds;
+};
+
+// totals since the start of the program or the last reset()
+Snapshot snapshot();
+void reset();
+const char *counter_name(Counter c);
+const char *phase_name(Phase p);
+// wall is the real time taken, which for many threads is less than the
+// sum of phases. print() makes a table, print_json() a single JSON object
+void print(FILE *fp, const Snapshot &s, double wall);
+void print_json(FILE *fp, const Snapshot &s, double wall);
+
+} // namespace chr::stats
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+#include <fmt/core.h>
+#include "chr.hpp"
+#include "kernels.hpp"
+
+// Checks for the parts of the library chrconvert doesn't go through, run by
+// test.sh. Everything is checked at every SIMD level the CPU supports, and
+// must give exactly the same results as the scalar kernels and to_indexed().
+
+namespace {
+    int num_failed = 0;
+
+    template <typename... T>
+    void check(bool ok, fmt::format_string<T...> what, T &&...args)
+    {
+        if (!ok) {
+            fmt::print("failed: {}\n", fmt::format(what, std::forward<T>(args)...));
+            num_failed++;
+        }
+    }
+
+    // deterministic, so that failures can be reproduced
+    std::vector<uint8_t> random_bytes(std::size_t n, uint8_t mask = 0xFF)
+    {
+        static uint32_t seed = 1;
+        std::vector<uint8_t> bytes(n);
+        for (auto &b : bytes) {
+            seed = seed * 1103515245 + 12345;
+            b = (seed >> 16) & mask;
+        }
+        return bytes;
+    }
+
+    const char *mode_name(chr::DataMode mode)
+    {
+        return mode == chr::DataMode::Planar ? "planar" : "interwined";
+    }
+
+    // every length up to a few vectors, to go through all the tails
+    void check_palettize(chr::SimdLevel level)
+    {
+        auto palettize = chr::kernels::palettize_kernel(level);
+        std::array<uint32_t, 256> lut;
+        auto lut_bytes = random_bytes(sizeof(lut));
+        std::memcpy(lut.data(), lut_bytes.data(), sizeof(lut));
+        for (int bpp = 1; bpp <= 8; bpp++) {
+            for (std::size_t n = 0; n <= 200; n++) {
+                auto pixels = random_bytes(n, (1 << bpp) - 1);
+                std::vector<uint32_t> expected(n), out(n);
+                chr::kernels::palettize_scalar(pixels.data(), n, lut.data(), 1 << bpp, expected.data());
+                palettize(pixels.data(), n, lut.data(), 1 << bpp, out.data());
+                check(out == expected, "palettize, {}, {} bpp, {} pixels", chr::simd_level_name(level), bpp, n);
+            }
+        }
+    }
+
+    // the output has a wider stride than needed, whose padding must be left alone
+    void check_decode_into(chr::SimdLevel level, std::size_t num_tiles, int min_bpp = 1, int max_bpp = 8)
+    {
+        const std::size_t stride = chr::ROW_SIZE + 8;
+        // with random colors, so that RGBA and BGRA differ
+        std::vector<chr::ColorRGBA> colors(256);
+        auto color_bytes = random_bytes(colors.size() * 4);
+        for (std::size_t i = 0; i < colors.size(); i++)
+            colors[i] = chr::ColorRGBA{std::span{&color_bytes[i*4], 4}};
+
+        for (int bpp = min_bpp; bpp <= max_bpp; bpp++) {
+            for (auto mode : { chr::DataMode::Planar, chr::DataMode::Interwined }) {
+                auto data = random_bytes(num_tiles * bpp*8);
+                std::size_t height = chr::img_height(data.size(), bpp);
+                std::vector<uint8_t> expected(height * stride, 0xEE);
+                std::size_t y = 0;
+                chr::to_indexed(data, bpp, mode, [&](std::span<uint8_t> row) {
+                    std::copy(row.begin(), row.end(), &expected[y++ * stride]);
+                });
+                std::vector<uint8_t> indexed(height * stride, 0xEE);
+                bool ok = chr::decode_into(data, indexed, stride, bpp, mode);
+                check(ok && indexed == expected, "decode_into, {}, {} bpp {}, {} tiles",
+                      chr::simd_level_name(level), bpp, mode_name(mode), num_tiles);
+
+                chr::Palette palette{std::span{colors}.first(1 << bpp)};
+                for (auto format : { chr::PixelFormat::RGBA, chr::PixelFormat::BGRA }) {
+                    std::array<uint32_t, 256> pixels;
+                    for (int i = 0; i < 1 << bpp; i++) {
+                        auto c = palette[i];
+                        std::array<uint8_t, 4> bytes = format == chr::PixelFormat::RGBA
+                            ? std::array<uint8_t, 4>{ c.red(),  c.green(), c.blue(), c.alpha() }
+                            : std::array<uint8_t, 4>{ c.blue(), c.green(), c.red(),  c.alpha() };
+                        std::memcpy(&pixels[i], bytes.data(), 4);
+                    }
+                    std::vector<uint32_t> expected_colors(height * stride, 0xEEEEEEEE);
+                    for (std::size_t i = 0; i < expected.size(); i++)
+                        if (i % stride < chr::ROW_SIZE)
+                            expected_colors[i] = pixels[expected[i]];
+                    std::vector<uint32_t> image(height * stride, 0xEEEEEEEE);
+                    ok = chr::decode_into(data, image, stride, bpp, mode, palette, format);
+                    check(ok && image == expected_colors, "decode_into {}, {}, {} bpp {}, {} tiles",
+                          format == chr::PixelFormat::RGBA ? "rgba" : "bgra",
+                          chr::simd_level_name(level), bpp, mode_name(mode), num_tiles);
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    for (int l = 0; l <= static_cast<int>(chr::best_simd_level()); l++) {
+        auto level = static_cast<chr::SimdLevel>(l);
+        chr::set_simd_level(level);
+        check_palettize(level);
+        // one tile, less than a strip and a strip and a half on one thread,
+        // then enough strips to be split among threads, which is the same
+        // for every bpp and slow in debug builds
+        chr::set_num_threads(1);
+        for (std::size_t num_tiles : { 1, 5, 24 })
+            check_decode_into(level, num_tiles);
+        chr::set_num_threads(4);
+        check_decode_into(level, chr::TILES_PER_ROW * 2 * chr::detail::PARALLEL_MIN_STRIPS + 3, 2, 2);
+    }
+    return num_failed == 0 ? 0 : 1;
+}
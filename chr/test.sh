@@ -26,6 +26,251 @@ test_file_reverse() {
     rm "$f.2.png"
 }
 
+# pipes are decoded as they're read, without knowing the height upfront:
+# the PNG must be the same as for the file, whether it's written to a file
+# or to another pipe, and memory use must not grow with the input
+test_pipe() {
+    f=$1
+    n=$2
+    bpp=$3
+    datamode=$4
+    ./debug/chrconvert "$f.chr" -o "$f.1.png" -b $bpp -d $datamode
+    cat "$f.chr" | ./debug/chrconvert - -o "$f.png" -b $bpp -d $datamode
+    cat "$f.chr" | ./debug/chrconvert - -o - -b $bpp -d $datamode | cat > "$f.2.png"
+    ./debug/chrconvert -r "$f.png" -o - -b $bpp -d $datamode > "$f.2.chr"
+    if [[ $(diff "$f.chr" "$f.2.chr") ]] || [[ $(cmp "$f.1.png" "$f.png") ]] || [[ $(cmp "$f.1.png" "$f.2.png") ]]; then
+        echo "test" $n "failed"
+    fi
+    # 16M through 12M of memory
+    head -c 16M /dev/zero | (ulimit -v 12000; ./debug/chrconvert - -o "$f.3.png" -b $bpp -d $datamode) \
+    || echo "test" $n "failed (memory)"
+    if [[ $(png_info "$f.3.png") != "128 $((16*1024*1024 / (bpp*8*16) * 8)) $((1 << bpp))" ]]; then
+        echo "test" $n "failed (height)"
+    fi
+    rm -f "$f.png" "$f.1.png" "$f.2.png" "$f.3.png" "$f.2.chr"
+}
+
+# big enough to be split among threads: the output with 4 threads must be
+# the same as with 1, and still convert back to the input
+test_threads() {
+    f=$1
+    n=$2
+    bpp=$3
+    datamode=$4
+    head -c $((1536*1024 + 3*bpp*128)) /dev/urandom > "$f.chr"
+    ./debug/chrconvert "$f.chr" -o "$f.1.png" -b $bpp -d $datamode -j 1
+    ./debug/chrconvert "$f.chr" -o "$f.4.png" -b $bpp -d $datamode -j 4
+    ./debug/chrconvert -r "$f.4.png" -o "$f.1.chr" -b $bpp -d $datamode -j 1
+    ./debug/chrconvert -r "$f.4.png" -o "$f.4.chr" -b $bpp -d $datamode -j 4
+    if [[ $(cmp "$f.1.png" "$f.4.png") ]] || [[ $(cmp "$f.chr" "$f.1.chr") ]] || [[ $(cmp "$f.chr" "$f.4.chr") ]]; then
+        echo "test" $n "failed"
+    fi
+    rm "$f.chr" "$f.1.png" "$f.4.png" "$f.1.chr" "$f.4.chr"
+}
+
+# rebuilds the whole chr from the unique tiles and the tilemap
+test_tilemap() {
+    f=$1
+    n=$2
+    bpp=$3
+    datamode=$4
+    ./debug/chrconvert "$f.chr" -o "$f.png" -b $bpp -d $datamode
+    ./debug/chrconvert -r "$f.png" -o "$f.unique.chr" -t "$f.map" -b $bpp -d $datamode
+    for i in $(od -An -v -tu2 "$f.map"); do
+        dd if="$f.unique.chr" bs=$((bpp*8)) skip=$i count=1 status=none
+    done > "$f.2.chr"
+    if [[ $(diff "$f.chr" "$f.2.chr") ]] || [[ $(stat -c %s "$f.unique.chr") -ge $(stat -c %s "$f.chr") ]]; then
+        echo "test" $n "failed"
+    fi
+    rm "$f.png" "$f.unique.chr" "$f.map" "$f.2.chr"
+}
+
+# bits of each byte value in reverse order, for flipping rows horizontally
+rev=()
+for ((i = 0; i < 256; i++)); do
+    r=0
+    for ((b = 0; b < 8; b++)); do
+        ((r |= (i >> b & 1) << (7 - b)))
+    done
+    rev[i]=$r
+done
+
+# flip_tile bpp datamode flips bytes...: prints the tile's bytes flipped
+# horizontally if bit 0 of flips is set and vertically if bit 1 is
+flip_tile() {
+    local bpp=$1 datamode=$2 flips=$3
+    shift 3
+    local in=("$@") out=() k j
+    for ((k = 0; k < bpp*8; k++)); do
+        j=$k
+        if ((flips & 2)); then
+            # each byte is a row of a plane: planar planes and the odd one
+            # out at the end take 8 bytes, interwined pairs alternate rows
+            if [[ $datamode == planar ]] || ((bpp % 2 && k >= (bpp-1)*8)); then
+                ((j = k/8*8 + 7 - k%8))
+            else
+                ((j = k/16*16 + (7 - k%16/2)*2 + k%2))
+            fi
+        fi
+        out[j]=${in[k]}
+        if ((flips & 1)); then
+            out[j]=${rev[${in[k]}]}
+        fi
+    done
+    echo "${out[@]}"
+}
+
+write_bytes() {
+    printf '%b' "$(printf '\\%03o' "$@")"
+}
+
+# the input gets flipped copies of its first 16 tiles, which must be matched
+# to the originals and then be rebuilt from them with the flip bits
+test_tilemap_flips() {
+    f=$1
+    n=$2
+    bpp=$3
+    datamode=$4
+    size=$((bpp*8))
+    tiles=($(od -An -v -tu1 "$f.chr"))
+    {
+        cat "$f.chr"
+        for flips in 1 2 3; do
+            for ((i = 0; i < 16; i++)); do
+                write_bytes $(flip_tile $bpp $datamode $flips "${tiles[@]:i*size:size}")
+            done
+        done
+    } > "$f.flips.chr"
+    ./debug/chrconvert "$f.flips.chr" -o "$f.png" -b $bpp -d $datamode
+    ./debug/chrconvert -r "$f.png" -o "$f.unique.chr" -t "$f.map" -b $bpp -d $datamode
+    ./debug/chrconvert -r "$f.png" -o "$f.unique.flips.chr" -t "$f.flips.map" -F -b $bpp -d $datamode
+    unique=($(od -An -v -tu1 "$f.unique.flips.chr"))
+    for e in $(od -An -v -tu2 "$f.flips.map"); do
+        i=$((e & 0x3FFF))
+        write_bytes $(flip_tile $bpp $datamode $((e >> 14)) "${unique[@]:i*size:size}")
+    done > "$f.2.chr"
+    if [[ $(cmp "$f.flips.chr" "$f.2.chr") ]] \
+    || [[ $(stat -c %s "$f.unique.flips.chr") -ge $(stat -c %s "$f.unique.chr") ]]; then
+        echo "test" $n "failed"
+    fi
+    rm "$f.flips.chr" "$f.png" "$f.unique.chr" "$f.map" "$f.unique.flips.chr" "$f.flips.map" "$f.2.chr"
+}
+
+# two files converted in one run, both given on the command line and in a
+# list, with outputs named after the inputs
+test_batch() {
+    f=$1
+    n=$2
+    bpp=$3
+    datamode=$4
+    cp "$f.chr" "$f.a.chr"
+    head -c $((bpp*8 * 16)) "$f.chr" > "$f.b.chr"
+    ./debug/chrconvert "$f.a.chr" "$f.b.chr" -o "{dir}/{name}.png" -b $bpp -d $datamode 2> /dev/null \
+    || echo "test" $n "failed (-o)"
+    printf '# both files\n%s\n\n%s\n' "$f.a.png" "$f.b.png" > "$f.list"
+    ./debug/chrconvert -r -l "$f.list" -o "{dir}/{name}.2.chr" -b $bpp -d $datamode 2> /dev/null \
+    || echo "test" $n "failed (-l)"
+    if [[ $(cmp "$f.a.chr" "$f.a.2.chr") ]] || [[ $(cmp "$f.b.chr" "$f.b.2.chr") ]]; then
+        echo "test" $n "failed"
+    fi
+    rm -f "$f".{a,b}.chr "$f".{a,b}.png "$f".{a,b}.2.chr "$f.list"
+}
+
+# prints the width, height and number of palette entries of a PNG written
+# by chrconvert, which puts PLTE right after IHDR
+png_info() {
+    local b=($(od -An -v -tu1 -j16 -N8 "$1") $(od -An -v -tu1 -j33 -N4 "$1"))
+    echo $((b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3])) $((b[4] << 24 | b[5] << 16 | b[6] << 8 | b[7])) \
+         $(((b[8] << 24 | b[9] << 16 | b[10] << 8 | b[11]) / 3))
+}
+
+# ${f}_rgb.png is $f.chr as a truecolor image with every color a bit off
+# the palette's: -q must find the right ones. dithering and fewer bpp must
+# still give a whole image, with only as many colors as bpp allows
+test_quantize() {
+    f=$1
+    n=$2
+    bpp=$3
+    datamode=$4
+    ./debug/chrconvert -r "${f}_rgb.png" -o "$f.2.chr" -q -b $bpp -d $datamode
+    if [[ $(cmp "$f.chr" "$f.2.chr") ]]; then
+        echo "test" $n "failed"
+    fi
+    size=$(stat -c %s "$f.chr")
+    for b in $bpp 1; do
+        ./debug/chrconvert -r "${f}_rgb.png" -o "$f.2.chr" -q -D -b $b -d $datamode
+        ./debug/chrconvert "$f.2.chr" -o "$f.png" -b $b -d $datamode
+        if [[ $(stat -c %s "$f.2.chr") -ne $((size / bpp * b)) ]] \
+        || [[ $(png_info "$f.png") != "$(png_info "${f}_rgb.png" | cut -d' ' -f1,2) $((1 << b))" ]]; then
+            echo "test" $n "failed (-D -b $b)"
+        fi
+    done
+    rm "$f.2.chr" "$f.png"
+}
+
+# writes an iNES header with bytes 4 to 9 as given, then pads it to 16 bytes
+nes_header() {
+    printf 'NES\x1A'
+    write_bytes "$@"
+    head -c $((12 - $#)) /dev/zero
+}
+
+# the CHR-ROM of a ROM must convert exactly like the same data in a .chr
+# file. the ROMs have 16K of PRG-ROM and 8K of CHR-ROM, whose second 4K bank
+# is the test file. broken ROMs and banks must fail
+test_rom() {
+    f=$1
+    n=$2
+    head -c 4096 /dev/urandom > "$f.rom.chr"
+    cat "$f.chr" >> "$f.rom.chr"
+    ./debug/chrconvert "$f.rom.chr" -o "$f.png"
+    ./debug/chrconvert "$f.chr" -o "$f.bank.png"
+    prg() { head -c 16384 /dev/urandom; }
+    { nes_header 1 1 0 0 0 0; prg; cat "$f.rom.chr"; } > "$f.ines.nes"
+    # NES 2.0, CHR size as 2^13 * 1
+    { nes_header 1 $((13 << 2)) 0 8 0 $((0xF0)); prg; cat "$f.rom.chr"; } > "$f.nes2.nes"
+    { nes_header 1 1 4 0 0 0; head -c 512 /dev/urandom; prg; cat "$f.rom.chr"; } > "$f.trainer.nes"
+    { nes_header 1 0 0 0 0 0; prg; } > "$f.chrram.nes"
+    head -c -1 "$f.ines.nes" > "$f.short.nes"
+
+    for rom in ines nes2 trainer; do
+        ./debug/chrconvert "$f.$rom.nes" -o "$f.2.png"
+        if [[ $(cmp "$f.png" "$f.2.png") ]]; then
+            echo "test" $n "failed ($rom)"
+        fi
+    done
+    # ROMs and banks from pipes are read whole
+    cat "$f.ines.nes" | ./debug/chrconvert - -o "$f.2.png"
+    if [[ $(cmp "$f.png" "$f.2.png") ]]; then
+        echo "test" $n "failed (pipe)"
+    fi
+    ./debug/chrconvert "$f.ines.nes" -o "$f.2.png" -k 4k:1
+    if [[ $(cmp "$f.bank.png" "$f.2.png") ]]; then
+        echo "test" $n "failed (bank)"
+    fi
+    cat "$f.ines.nes" | ./debug/chrconvert - -o "$f.2.png" -k 4k:1
+    if [[ $(cmp "$f.bank.png" "$f.2.png") ]]; then
+        echo "test" $n "failed (bank, pipe)"
+    fi
+    for args in "$f.ines.nes -k 4k:2" "$f.ines.nes -k 8k:1" "$f.chrram.nes" "$f.short.nes"; do
+        if ./debug/chrconvert $args -o "$f.2.png" 2> /dev/null; then
+            echo "test" $n "failed ($args)"
+        fi
+    done
+    rm -f "$f.rom.chr" "$f.png" "$f.bank.png" "$f.2.png" "$f".{ines,nes2,trainer,chrram,short}.nes
+}
+
 test_file "test/bpp2" 1 2 planar
 test_file "test/bpp4" 2 4 interwined
 # test_file_reverse "test/tile" 3 2
+test_pipe "test/bpp2" 4 2 planar
+test_tilemap "test/bpp2" 5 2 planar
+test_tilemap_flips "test/bpp4" 6 4 interwined
+test_threads "test/big" 7 2 planar
+test_threads "test/big4" 8 4 interwined
+test_tilemap_flips "test/bpp2" 9 2 planar
+test_rom "test/bpp2" 10
+test_batch "test/bpp4" 11 4 interwined
+test_quantize "test/bpp2" 12 2 planar
+# the library checks that don't go through chrconvert
+./debug/chrtest || echo "test 13 failed"